@@ -16,6 +16,7 @@ Maintainer: Miguel Luis and Gregory Cristian
 #include <stdio.h>
 #include <stdint.h>
 #include "utilities.h"
+#include "crc32.h"
 
 /*!
  * Redefinition of rand() and srand() standard C functions.
@@ -86,56 +87,29 @@ int8_t Nibble2HexChar( uint8_t a )
 
 uint32_t Crc32( uint8_t *buffer, uint16_t length )
 {
-    // The CRC calculation follows CCITT - 0x04C11DB7
-    const uint32_t reversedPolynom = 0xEDB88320;
-
-    // CRC initial value
-    uint32_t crc = 0xFFFFFFFF;
-
     if( buffer == NULL )
     {
         return 0;
     }
 
-    for( uint16_t i = 0; i < length; ++i )
-    {
-        crc ^= ( uint32_t )buffer[i];
-        for( uint16_t i = 0; i < 8; i++ )
-        {
-            crc = ( crc >> 1 ) ^ ( reversedPolynom & ~( ( crc & 0x01 ) - 1 ) );
-        }
-    }
-
-    return ~crc;
+    // The CRC calculation follows CCITT - 0x04C11DB7, see crc32.h for the
+    // hardware and table-driven implementations
+    return ~crc32_update( CRC32_INIT, buffer, length );
 }
 
 uint32_t Crc32Init( void )
 {
-    return 0xFFFFFFFF;
+    return CRC32_INIT;
 }
 
 uint32_t Crc32Update( uint32_t crcInit, uint8_t *buffer, uint16_t length )
 {
-    // The CRC calculation follows CCITT - 0x04C11DB7
-    const uint32_t reversedPolynom = 0xEDB88320;
-
-    // CRC initial value
-    uint32_t crc = crcInit;
-
     if( buffer == NULL )
     {
         return 0;
     }
 
-    for( uint16_t i = 0; i < length; ++i )
-    {
-        crc ^= ( uint32_t )buffer[i];
-        for( uint16_t i = 0; i < 8; i++ )
-        {
-            crc = ( crc >> 1 ) ^ ( reversedPolynom & ~( ( crc & 0x01 ) - 1 ) );
-        }
-    }
-    return crc;
+    return crc32_update( crcInit, buffer, length );
 }
 
 uint32_t Crc32Finalize( uint32_t crc )
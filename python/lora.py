@@ -39,7 +39,7 @@ from abc import ABC
 from functools import lru_cache
 from collections import namedtuple
 from contextlib import contextmanager
-from typing import Optional, Tuple, Union, List, Any, Set
+from typing import Optional, Tuple, Union, List, Any, Set, Dict
 from datetime import datetime, timedelta
 from enum import Enum, unique, auto
 from threading import Thread, RLock
@@ -93,6 +93,9 @@ UARTConfig = namedtuple('UARTConfig', 'baudrate data_bits stop_bits parity flow_
 RFConfig   = namedtuple('RFConfig',   'id frequency min_dr max_dr')
 Delay      = namedtuple('Delay',      'join_accept_1 join_accept_2 rx_window_1 rx_window_2')
 McastAddr  = namedtuple('McastAddr',  'id addr nwkskey appskey')
+Downlink   = namedtuple('Downlink',   'port rssi snr fcnt age payload')
+UARTStats  = namedtuple('UARTStats',  'rx_bytes tx_bytes rx_dropped parity_errors framing_errors noise_errors overruns rx_peak tx_peak tx_blocked_ms urc_dropped')
+TxDone     = namedtuple('TxDone',     'handle fcnt datarate channel frequency tx_power time_on_air nb_trans status')
 
 
 class ModemError(Exception):
@@ -314,6 +317,7 @@ class Errno(Enum):
     ERR_DUTYCYCLE     = -18
     ERR_NO_CHANNEL    = -19
     ERR_TOO_MANY      = -20
+    ERR_NO_DATA       = -21
 
 
 @unique
@@ -357,10 +361,69 @@ error_messages = {
     Errno.ERR_UNSUPPORTED.value   : 'Not supported in the current region',
     Errno.ERR_DUTYCYCLE.value     : 'Cannot transmit due to duty cycling',
     Errno.ERR_NO_CHANNEL.value    : 'Channel unavailable due to LBT or error',
-    Errno.ERR_TOO_MANY.value      : 'Too many link check requests'
+    Errno.ERR_TOO_MANY.value      : 'Too many link check requests',
+    Errno.ERR_NO_DATA.value       : 'No downlink available in the mailbox'
 }
 
 
+# Binary framed host protocol, see AT$FRAME and src/atci.h in the firmware
+FRAME_REQUEST       = 0x01
+FRAME_URC           = 0x80
+FRAME_RESPONSE      = 0x81
+FRAME_RESPONSE_MORE = 0x82
+
+TLV_TEXT    = 0x01
+TLV_HEX     = 0x02
+TLV_PAYLOAD = 0x03
+
+
+def crc16(data: bytes, crc: int = 0xffff) -> int:
+    '''CRC-16/CCITT-FALSE'''
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+        crc &= 0xffff
+    return crc
+
+
+def cobs_encode(data: bytes) -> bytes:
+    out = bytearray()
+    block = bytearray()
+    for b in data:
+        if b == 0:
+            out += bytes([len(block) + 1]) + block
+            block = bytearray()
+        else:
+            block.append(b)
+            if len(block) == 254:
+                out += b'\xff' + block
+                block = bytearray()
+    out += bytes([len(block) + 1]) + block
+    return bytes(out)
+
+
+def cobs_decode(data: bytes) -> bytes:
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise ValueError('Malformed COBS frame')
+        out += data[i + 1:i + code]
+        i += code
+        if code != 0xff and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def tlv(type: int, value: bytes) -> bytes:
+    # Values longer than 255 bytes are split into multiple parameters of the
+    # same type. The modem concatenates TEXT and HEX parameters.
+    return b''.join(bytes([type, len(value[i:i + 255])]) + value[i:i + 255]
+        for i in range(0, max(len(value), 1), 255))
+
+
 class EventSubscription(EventEmitter):
     def wait_for(self, event: str, timeout: Optional[float] = None):
         q: "Queue[tuple]" = Queue()
@@ -402,6 +465,11 @@ class TypeABZ:
         self.subscriptions = set()
         self.guard = guard
         self.prev_at = None
+        self.framed = False
+        self.framing_change: Optional[Tuple[int, bool]] = None
+        self.next_id = 1
+        self.frame_responses: dict[int, "Queue[bytes]"] = {}
+        self.frame_parts: dict[int, bytes] = {}
 
     def __str__(self):
         return self.pathname
@@ -426,7 +494,7 @@ class TypeABZ:
             self.subscriptions.remove(sub)
             sub.off_all()
 
-    def detect_baud_rate(self, speeds=[9600, 19200, 38400, 4800], response=b'+OK\r', timeout=0.3) -> Optional[int]:
+    def detect_baud_rate(self, speeds=[9600, 19200, 38400, 4800, 57600, 115200, 230400, 460800], response=b'+OK\r', timeout=0.3) -> Optional[int]:
         if self.port is not None:
             raise Exception('Baudrate detection must be performed before the device is open')
 
@@ -517,10 +585,65 @@ class TypeABZ:
                 return line
             line += c
 
+    def read_frame(self) -> bytes:
+        assert self.port is not None
+
+        frame: bytes = b''
+        while True:
+            select.select([self.port.fd], [], [])
+            c = self.port.read()
+            if len(c) == 0:
+                raise Exception('No data')
+            if c == b'\0':
+                if len(frame) != 0:
+                    return frame
+                continue
+            frame += c
+
+    def receive_frame(self, frame: bytes):
+        try:
+            data = cobs_decode(frame)
+        except ValueError:
+            data = b''
+        if len(data) < 4 or crc16(data[:-2]) != int.from_bytes(data[-2:], 'little'):
+            if self.verbose:
+                print('! Dropping invalid frame')
+            return
+
+        id, type, body = data[0], data[1], data[2:-2]
+        if self.verbose:
+            print(f'> [{id}] {body.decode("ascii", errors="replace")!r}')
+
+        if type == FRAME_URC:
+            # The payload of +RECV is sent as raw bytes in the framed mode and
+            # follows the +RECV line within the same frame.
+            while len(body):
+                line, _, body = body.partition(b'\r\n\r\n')
+                if line.startswith(b'+RECV'):
+                    port, size = tuple(map(int, line[6:].split(b',')))
+                    self.emit('message', port, body[:size])
+                    body = body[size + 2:]
+                elif len(line):
+                    self.receive(line)
+        elif type == FRAME_RESPONSE_MORE:
+            self.frame_parts[id] = self.frame_parts.get(id, b'') + body
+        elif type == FRAME_RESPONSE:
+            body = self.frame_parts.pop(id, b'') + body
+            if self.framing_change is not None and self.framing_change[0] == id:
+                if body.startswith(b'+OK'):
+                    self.framed = self.framing_change[1]
+                self.framing_change = None
+            q = self.frame_responses.get(id)
+            if q is not None:
+                q.put_nowait(body)
+
     def reader(self):
         try:
             while True:
                 try:
+                    if self.framed:
+                        self.receive_frame(self.read_frame())
+                        continue
                     data = self.read_line()
                 except:
                     break
@@ -558,13 +681,22 @@ class TypeABZ:
     def receive(self, data: bytes):
         assert self.port is not None
 
+        # Switch the reader to the framed mode right after the modem has
+        # confirmed AT$FRAME=1. The modem sends frames from now on.
+        if self.framing_change is not None and self.framing_change[0] == 0:
+            if data == b'+OK':
+                self.framed = self.framing_change[1]
+                self.framing_change = None
+            elif data.startswith(b'+ERR='):
+                self.framing_change = None
+
         if data.startswith(b'+EVENT'):
             payload = data[7:]
             if len(payload) == 0:
                 self.emit('event')
             else:
                 params = tuple(map(int, payload.split(b',')))
-                if len(params) != 2:
+                if len(params) not in (2, 3):
                     raise Exception('Unsupported event parameters')
 
                 # For each event received from the LoRa module, we generate
@@ -572,16 +704,28 @@ class TypeABZ:
                 # subscribe to all event, event "event=x" allows the application
                 # to subscribe to all events from a specific subsystem, and
                 # event=x,y allows the application to subscribe to one specific
-                # event.
+                # event. With uplink handles enabled, retransmission events
+                # carry the handle of the uplink as an extra parameter.
                 self.emit('event', *params)
-                self.emit(f'event={params[0]}', params[1])
-                self.emit(f'event={params[0]},{params[1]}')
+                self.emit(f'event={params[0]}', *params[1:])
+                self.emit(f'event={params[0]},{params[1]}', *params[2:])
         elif data.startswith(b'+ANS'):
             self.emit('answer', *tuple(map(int, data[5:].split(b','))))
         elif data.startswith(b'+ACK'):
-            self.emit('ack', True)
+            # With uplink handles enabled, the handle follows the boolean
+            self.emit('ack', True, *tuple(map(int, data[5:].split(b',') if data[5:] else ())))
         elif data.startswith(b'+NOACK'):
-            self.emit('ack', False)
+            self.emit('ack', False, *tuple(map(int, data[7:].split(b',') if data[7:] else ())))
+        elif data.startswith(b'+QTX'):
+            # The handle of the queued uplink, its FCnt, and the result
+            self.emit('uplink', *tuple(map(int, data[5:].split(b','))))
+        elif data.startswith(b'+TXDONE'):
+            # Uplink handle, FCnt, DR, channel, frequency, TX power index, time
+            # on air (ms), number of transmissions, and the LoRaMac event status
+            self.emit('txdone', TxDone(*map(int, data[8:].split(b','))))
+        elif data.startswith(b'+FTX'):
+            # The id of the transfer, bytes sent, payload size, and the result
+            self.emit('fragment', *tuple(map(int, data[5:].split(b','))))
         elif data.startswith(b'+RECV'):
             port, size = tuple(map(int, data[6:].split(b',')))
             # We use +2 here to skip an empty line sent by the modem
@@ -626,7 +770,77 @@ class TypeABZ:
                 finally:
                     self.response.task_done()
 
-    def AT(self, cmd: str = '', timeout: Optional[float] = 5, wait=True, inline=True, flush=True, encoding='ascii', prefix=b'AT'):
+    def send_request(self, cmd: str, data: Optional[bytes] = None, payload: Optional[bytes] = None, encoding='ascii') -> int:
+        '''Send an AT command as a request frame in the framed mode.
+
+        The command is given without the AT prefix. The optional data is
+        appended to the command hex-encoded by the modem, e.g., to set a key.
+        The optional payload is passed to commands such as +UTX as is. Returns
+        the request id to be passed to read_response. Several requests may be
+        outstanding at the same time.
+        '''
+        assert self.port is not None
+        with self.lock:
+            id = self.next_id
+            self.next_id = self.next_id % 255 + 1
+            self.frame_responses[id] = Queue()
+
+            body = tlv(TLV_TEXT, cmd.encode(encoding))
+            if data is not None:
+                body += tlv(TLV_HEX, data)
+            if payload is not None:
+                body += tlv(TLV_PAYLOAD, payload)
+
+            frame = bytes([id, FRAME_REQUEST]) + body
+            frame += crc16(frame).to_bytes(2, 'little')
+            if self.verbose:
+                print(f'< [{id}] AT{cmd}')
+            self.port.write(b'\0' + cobs_encode(frame) + b'\0')
+            self.flush()
+            return id
+
+    def read_response(self, id: int, timeout: Optional[float] = 5, inline=True) -> Optional[bytes]:
+        try:
+            body = self.frame_responses[id].get(timeout=timeout)
+        except Empty:
+            raise TimeoutError('No response received')
+        finally:
+            del self.frame_responses[id]
+
+        lines = [line for line in body.split(b'\r\n') if len(line)]
+        if len(lines) and lines[0].startswith(b'+ERR='):
+            raise_for_error(int(lines[0][5:]))
+        if len(lines) == 0 or lines[-1] != b'+OK' and not (inline and lines[-1].startswith(b'+OK=')):
+            raise Exception('Invalid response')
+
+        if inline:
+            return lines[-1][4:] if lines[-1].startswith(b'+OK=') else None
+        return b'\n'.join(lines[:-1])
+
+    def enable_framing(self):
+        '''Switch the modem and the library to the binary framed protocol'''
+        if self.framed:
+            return
+        self.framing_change = (0, True)
+        self.AT('$FRAME=1')
+
+    def disable_framing(self):
+        '''Switch the modem and the library back to the text AT protocol'''
+        if not self.framed:
+            return
+        with self.lock:
+            id = self.send_request('$FRAME=0')
+            self.framing_change = (id, False)
+        self.read_response(id)
+
+    def AT(self, cmd: str = '', timeout: Optional[float] = 5, wait=True, inline=True, flush=True, encoding='ascii', prefix=b'AT', payload: Optional[bytes] = None):
+        if self.framed:
+            id = self.send_request(cmd, payload=payload, encoding=encoding)
+            if not wait:
+                return id
+            rv = self.read_response(id, timeout=timeout, inline=inline)
+            return rv.decode(encoding, errors='replace') if rv is not None else None
+
         # Implement rudimentary throttling of AT commands send to the device. It
         # appears the original modem firmware cannot properly interpret AT
         # commands that come quickly after a previous response. Thus, if the
@@ -661,6 +875,32 @@ class TypeABZ:
             self.prev_at = datetime.now()
             return rv
 
+    def AT_batch(self, cmds: List[str], timeout: Optional[float] = 5, encoding='ascii', prefix=b'AT'):
+        # The modem queues complete AT command lines and executes them in the
+        # order in which they were received, generating exactly one response
+        # per command. Thus, a sequence of commands can be sent in one burst
+        # and the responses can be matched to the commands by their order.
+        # Only commands with inline responses and no payload are supported.
+        # The modem can buffer roughly one kilobyte of pending command lines.
+        # The return value is a list with one item per command: the response
+        # value or the exception raised for the command.
+        rv: List[Optional[str] | Exception] = []
+        with self.lock:
+            for cmd in cmds:
+                self.write(prefix + cmd.encode(encoding), flush=False)
+            self.flush()
+
+            for _ in cmds:
+                try:
+                    value = self.read_inline_response(timeout=timeout)
+                    rv.append(value.decode(encoding, errors='replace') if value is not None else None)
+                except TimeoutError:
+                    raise
+                except Exception as error:
+                    rv.append(error)
+            self.prev_at = datetime.now()
+        return rv
+
 
 class TowerSDK(TypeABZ):
     prefix = b'$LORA: '
@@ -816,18 +1056,20 @@ class MurataModem(ATCI):
         reply = self.modem.AT('+UART?').split(',')
         if len(reply) != 5:
             raise Exception('Unexpected reply to AT+UART')
-        return UARTConfig(int(reply[0]), int(reply[1]), int(reply[2]), int(reply[3]), reply[4] == 1)
+        return UARTConfig(int(reply[0]), int(reply[1]), int(reply[2]), int(reply[3]), int(reply[4]) == 1)
 
     @uart.setter
     def uart(self, value: UARTConfig | int):
         '''Configure the baud rate of the AT interface UART port.
 
-        This property can only be used to configure the baud rate of the port.
-        Other parameters such as data bits, parity, or stop bits cannot be
-        configured. Only the following baud rate values are supported: 4800,
-        9600, 19200, 38400. The configured value is permanently stored in NVM
-        (EEPROM). The modem will switch to the newly configured baud rate after
-        reboot.
+        This property can only be used to configure the baud rate and flow
+        control of the port. Other parameters such as data bits, parity, or
+        stop bits cannot be configured. Only the following baud rate values are
+        supported: 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800.
+        RTS/CTS flow control is recommended at higher baud rates and uses pins
+        PB14 (RTS) and PB13 (CTS) of the modem. The configuration is permanently
+        stored in NVM (EEPROM). The modem will switch to the new configuration
+        after reboot.
 
         The default configuration of the UART port after factory reset is 19200
         8N1.
@@ -835,7 +1077,10 @@ class MurataModem(ATCI):
         if isinstance(value, tuple):
             value = UARTConfig(*value)
 
-        self.modem.AT(f'+UART={value.baudrate if isinstance(value, UARTConfig) else value}')
+        if isinstance(value, UARTConfig):
+            self.modem.AT(f'+UART={value.baudrate},8,1,0,{int(bool(value.flow_control))}')
+        else:
+            self.modem.AT(f'+UART={value}')
 
     @property
     def ver(self):
@@ -2032,11 +2277,10 @@ class MurataModem(ATCI):
         The maximum size of the payload depends on the current LoRaWAN data
         rate. The size could be reduced further if the modem needs to piggyback
         any MAC commands onto the uplink. If the payload does not fit in the
-        uplink, the modem responds with +ERR=-12. If any MAC commands waited to
-        be piggybacked, the modem internally sends an empty uplink to "flush"
-        the MAC commands even when it returns +ERR=-12 to the application. This
-        is to ensure that the next uplink transmission will have as much space
-        as possible dedicated to application payload.
+        uplink, the modem responds with +ERR=-12. If the payload only does not
+        fit because of MAC commands waiting to be piggybacked, the modem sends
+        an empty uplink to "flush" the MAC commands first and then sends the
+        payload automatically once the duty cycle permits.
         '''
         self.tx(data, confirmed=False, timeout=timeout, hex=hex)
 
@@ -2062,11 +2306,10 @@ class MurataModem(ATCI):
         The maximum size of the payload depends on the current LoRaWAN data
         rate. The size could be reduced further if the modem needs to piggyback
         any MAC commands onto the uplink. If the payload does not fit in the
-        uplink, the modem responds with +ERR=-12. If any MAC commands waited to
-        be piggybacked, the modem internally sends an empty uplink to "flush"
-        the MAC commands even when it returns +ERR=-12 to the application. This
-        is to ensure that the next uplink transmission will have as much space
-        as possible dedicated to application payload.
+        uplink, the modem responds with +ERR=-12. If the payload only does not
+        fit because of MAC commands waiting to be piggybacked, the modem sends
+        an empty uplink to "flush" the MAC commands first and then sends the
+        payload automatically once the duty cycle permits.
         '''
         rv = self.tx(data, confirmed=True, timeout=timeout, hex=hex)
         assert rv is not None
@@ -2077,10 +2320,14 @@ class MurataModem(ATCI):
         type = 'C' if confirmed else 'U'
         with self.modem.lock:
             with self.modem.events as events:
-                self.modem.AT(f'+{type}TX {len(data)}', wait=False, flush=False)
-                self.modem.port.write(binascii.hexlify(data) if hex else data)
-                self.modem.flush()
-                self.modem.read_inline_response()
+                if self.modem.framed:
+                    # The framed mode carries the payload as raw bytes
+                    self.modem.AT(f'+{type}TX {len(data)}', payload=data)
+                else:
+                    self.modem.AT(f'+{type}TX {len(data)}', wait=False, flush=False)
+                    self.modem.port.write(binascii.hexlify(data) if hex else data)
+                    self.modem.flush()
+                    self.modem.read_inline_response()
                 if confirmed:
                     # The +ACK +NOACK events carry one boolean value (True for +ACK,
                     # False for +NOACK)
@@ -2142,11 +2389,10 @@ class MurataModem(ATCI):
         The maximum size of the payload depends on the current LoRaWAN data
         rate. The size could be reduced further if the modem needs to piggyback
         any MAC commands onto the uplink. If the payload does not fit in the
-        uplink, the modem responds with +ERR=-12. If any MAC commands waited to
-        be piggybacked, the modem internally sends an empty uplink to "flush"
-        the MAC commands even when it returns +ERR=-12 to the application. This
-        is to ensure that the next uplink transmission will have as much space
-        as possible dedicated to application payload.
+        uplink, the modem responds with +ERR=-12. If the payload only does not
+        fit because of MAC commands waiting to be piggybacked, the modem sends
+        an empty uplink to "flush" the MAC commands first and then sends the
+        payload automatically once the duty cycle permits.
         '''
         self.ptx(port, data, confirmed=False, timeout=timeout, hex=hex)
 
@@ -2168,11 +2414,10 @@ class MurataModem(ATCI):
         The maximum size of the payload depends on the current LoRaWAN data
         rate. The size could be reduced further if the modem needs to piggyback
         any MAC commands onto the uplink. If the payload does not fit in the
-        uplink, the modem responds with +ERR=-12. If any MAC commands waited to
-        be piggybacked, the modem internally sends an empty uplink to "flush"
-        the MAC commands even when it returns +ERR=-12 to the application. This
-        is to ensure that the next uplink transmission will have as much space
-        as possible dedicated to application payload.
+        uplink, the modem responds with +ERR=-12. If the payload only does not
+        fit because of MAC commands waiting to be piggybacked, the modem sends
+        an empty uplink to "flush" the MAC commands first and then sends the
+        payload automatically once the duty cycle permits.
         '''
         rv = self.ptx(port, data, confirmed=True, timeout=timeout, hex=hex)
         assert rv is not None
@@ -2197,6 +2442,255 @@ class MurataModem(ATCI):
                 else:
                     return None
 
+    def qtx(self, port: int, data: bytes, confirmed = False, hex = False) -> int:
+        '''Queue an uplink message for transmission by the modem.
+
+        The modem sends queued uplinks one after another as soon as the MAC is
+        idle and the regional duty cycle permits, so the application does not
+        need to retry on +ERR=-7 or +ERR=-18. The method returns the handle of
+        the queued uplink. Once the uplink has been sent, the modem generates
+        the event "uplink" with the handle, the uplink frame counter, and the
+        result: 0 if the uplink was sent (and acknowledged if confirmed), 1 if
+        a confirmed uplink was not acknowledged, or a negative error code if
+        the uplink could not be sent.
+
+        If `dformat` is set to 1, the payload is sent hex-encoded and the
+        parameter `hex` must be set to True.
+        '''
+        assert self.modem.port is not None
+        cmd = f'$QTX {port},{int(confirmed)},{len(data)}'
+        with self.modem.lock:
+            if self.modem.framed:
+                return int(self.modem.AT(cmd, payload=data))
+
+            self.modem.AT(cmd, wait=False, flush=False)
+            self.modem.port.write(binascii.hexlify(data) if hex else data)
+            self.modem.flush()
+            return int(self.modem.read_inline_response())
+
+    @property
+    def queued_uplinks(self) -> int:
+        '''Return the number of uplinks queued with qtx, including the one
+        being sent.'''
+        return int(self.modem.AT('$QTX?'))
+
+    @property
+    def uplink_handles(self) -> bool:
+        '''Return True if the modem tags uplinks with handles.'''
+        return self.modem.AT('$HANDLES?') == '1'
+
+    @uplink_handles.setter
+    def uplink_handles(self, value: bool):
+        '''Enable or disable uplink handles.
+
+        When enabled, the modem responds to AT+UTX, AT+CTX, AT+PUTX, and
+        AT+PCTX with a handle from a monotonically increasing sequence, and
+        +ACK and +NOACK carry the handle of the acknowledged uplink. The "ack"
+        event then has the handle as its second argument. Retransmission
+        events (+EVENT=2,2) carry the handle of the retransmitted uplink as a
+        third parameter. The handles returned
+        by qtx and carried by the "uplink" and "txdone" events come from the
+        same sequence. The value is stored in NVM.
+        '''
+        self.modem.AT(f'$HANDLES={int(bool(value))}')
+
+    @property
+    def txdone_events(self) -> bool:
+        '''Return True if the modem reports completed uplinks with +TXDONE.'''
+        return self.modem.AT('$TXDONE?') == '1'
+
+    @txdone_events.setter
+    def txdone_events(self, value: bool):
+        '''Enable or disable +TXDONE messages.
+
+        When enabled, the modem generates the event "txdone" with a TxDone
+        tuple once the MAC has finished each uplink, including unconfirmed
+        ones. The application can use the event to submit the next uplink as
+        soon as the MAC is free. The value is stored in NVM.
+        '''
+        self.modem.AT(f'$TXDONE={int(bool(value))}')
+
+    @property
+    def aggregation_window(self) -> int:
+        '''Return the uplink aggregation window in milliseconds (0: off).'''
+        return int(self.modem.AT('$AGGR?'))
+
+    @aggregation_window.setter
+    def aggregation_window(self, value: int):
+        '''Configure the uplink aggregation window in milliseconds.
+
+        With a non-zero value, uplinks queued with qtx wait for up to the given
+        time for further uplinks to the same port and the modem sends them
+        together in one frame. Each uplink in the frame is prefixed with its
+        length in one byte, see split_aggregated_uplink. The value 0 disables
+        aggregation. The value is stored in NVM.
+        '''
+        self.modem.AT(f'$AGGR={value}')
+
+    @staticmethod
+    def split_aggregated_uplink(payload: bytes) -> List[bytes]:
+        '''Split the payload of an aggregated uplink into individual messages.
+
+        This is meant for the application server receiving uplinks sent with
+        aggregation enabled.
+        '''
+        msgs = []
+        i = 0
+        while i < len(payload):
+            n = payload[i]
+            if i + 1 + n > len(payload):
+                raise ValueError('Truncated aggregated uplink')
+            msgs.append(payload[i + 1:i + 1 + n])
+            i += 1 + n
+        return msgs
+
+    @property
+    def config(self) -> Dict[str, str]:
+        '''Return all modem settings retrieved with a single AT$CONFIG? command.
+
+        The keys are AT command names including the + or $ prefix, e.g., "+DR",
+        and the values are the raw strings the modem would return for the
+        corresponding query. This is much faster than reading each setting
+        with a separate command. Settings whose value does not fit into the
+        modem's buffer are omitted.
+        '''
+        settings = {}
+        for line in self.modem.AT('$CONFIG?', inline=False).split('\n'):
+            name, sep, value = line.partition('=')
+            if sep:
+                settings[name] = value
+        return settings
+
+    @config.setter
+    def config(self, settings: Dict[str, str]):
+        '''Update multiple settings with as few AT$CONFIG commands as possible.
+
+        The argument uses the format returned by the config property. The
+        settings are sent in batches that fit into a single AT command line.
+        The modem applies the settings of each batch in order and stops at the
+        first failing setting.
+        '''
+        batch: List[str] = []
+        length = 0
+        for name, value in settings.items():
+            item = f'{name}={value}'
+            if len(batch) and length + len(item) + 1 > 240:
+                self.modem.AT(f'$CONFIG={";".join(batch)}')
+                batch, length = [], 0
+            batch.append(item)
+            length += len(item) + 1
+        if len(batch):
+            self.modem.AT(f'$CONFIG={";".join(batch)}')
+
+    def ftx(self, port: int, data: bytes, confirmed = False, hex = False, chunk = 242) -> int:
+        '''Send a payload larger than the maximum LoRaWAN payload in fragments.
+
+        The payload is uploaded to the modem in chunks of up to `chunk` bytes
+        and the modem then sends it in fragments sized to the current data rate
+        without further involvement of the host. The method returns the id of
+        the transfer. After each fragment, the modem generates the event
+        "fragment" with the id, the number of bytes sent, the payload size, and
+        the result: 0 on success, 1 if a confirmed fragment was not
+        acknowledged, or a negative error code. The transfer ends when all
+        bytes have been sent or with the first non-zero result. See
+        parse_fragment for the format of the fragments.
+
+        If `dformat` is set to 1, the payload is sent hex-encoded and the
+        parameter `hex` must be set to True.
+        '''
+        assert self.modem.port is not None
+        with self.modem.lock:
+            self.cancel_fragments()
+            for i in range(0, len(data), chunk):
+                part = data[i:i + chunk]
+                cmd = f'$FDATA {len(part)}'
+                if self.modem.framed:
+                    self.modem.AT(cmd, payload=part)
+                    continue
+
+                self.modem.AT(cmd, wait=False, flush=False)
+                self.modem.port.write(binascii.hexlify(part) if hex else part)
+                self.modem.flush()
+                self.modem.read_inline_response()
+
+            return int(self.modem.AT(f'$FTX {port},{int(confirmed)}'))
+
+    @property
+    def fragment_status(self) -> Tuple[int, int, int]:
+        '''Return the id of the fragmented transfer in progress (0 if none),
+        the number of bytes sent, and the payload size.'''
+        return tuple(map(int, self.modem.AT('$FTX?').split(',')))
+
+    def cancel_fragments(self):
+        '''Cancel the fragmented transfer in progress and discard the payload
+        uploaded to the modem.'''
+        self.modem.AT('$FTXDEL')
+
+    @staticmethod
+    def parse_fragment(payload: bytes) -> Tuple[int, int, bool, bytes]:
+        '''Parse an uplink fragment sent by the modem.
+
+        Returns the transfer id, the offset of the data within the payload,
+        whether the fragment is the last one, and the data. This is meant for
+        the application server reassembling payloads sent with ftx.
+        '''
+        if len(payload) < 3:
+            raise ValueError('Fragment too short')
+        offset = payload[1] | (payload[2] << 8)
+        return payload[0], offset & 0x7fff, bool(offset & 0x8000), payload[3:]
+
+    @property
+    def mailbox_depth(self) -> int:
+        '''Return the maximum number of downlinks kept in the modem mailbox.
+
+        The value 0 indicates that the mailbox is disabled and the modem sends
+        downlinks to the host with unsolicited +RECV messages.
+        '''
+        return int(self.modem.AT('$MAILBOX?'))
+
+    @mailbox_depth.setter
+    def mailbox_depth(self, value: int):
+        '''Configure the maximum number of downlinks kept in the modem mailbox.
+
+        With a non-zero value, the modem stores received downlinks in RAM and
+        does not send +RECV messages. The host can then sleep and fetch all
+        downlinks with fetch_downlink and drop_downlink later. Once the mailbox
+        is full, the oldest downlink is dropped for each new one. The value
+        must be in the range 0 to 255. The value is stored in NVM.
+
+        The mailbox memory in the modem (512 bytes by default) limits the
+        number of stored downlinks as well. It holds a single downlink with a
+        maximum-size payload (242 bytes), or, e.g., twelve downlinks with
+        payloads of up to 24 bytes. The oldest downlinks are dropped to make
+        room for a new one even if the configured depth has not been reached.
+        '''
+        self.modem.AT(f'$MAILBOX={value}')
+
+    @property
+    def mailbox(self):
+        '''Return the number of downlinks in the mailbox and the number of
+        downlinks dropped because the mailbox was full.'''
+        return tuple(map(int, self.modem.AT('$RECV?').split(',')))
+
+    def fetch_downlink(self) -> Optional[Downlink]:
+        '''Return the oldest downlink from the mailbox without removing it.
+
+        The age of the downlink is in milliseconds. Returns None if the mailbox
+        is empty.
+        '''
+        try:
+            reply = self.modem.AT('$RECV').split(',')
+        except ModemError as e:
+            if e.errno == Errno.ERR_NO_DATA.value:
+                return None
+            raise
+        return Downlink(int(reply[0]), int(reply[1]), int(reply[2]), int(reply[3]),
+            int(reply[4]), bytes.fromhex(reply[5]))
+
+    def drop_downlink(self):
+        '''Remove the oldest downlink from the mailbox.'''
+        self.modem.AT('$RECVDEL')
+
     @property
     def frmcnt(self):
         '''Return current uplink and downlink frame counters.
@@ -3305,6 +3799,25 @@ class OpenLoRaModem(MurataModem):
             rv['dev_addr'] = data[4]
         return rv
 
+    @property
+    def uart_stats(self):
+        '''Return statistics of the AT interface UART link.
+
+        The counters include received and transmitted bytes, received bytes
+        dropped because the modem did not keep up, the number of parity,
+        framing, noise, and overrun error events, the peak occupancy of the
+        receive and transmit queues in bytes, and the time in milliseconds the
+        modem spent waiting for space in a full transmit queue, and the number
+        of unsolicited messages (URCs) dropped because the host did not read
+        them fast enough. Use the counters to check whether a baud rate or
+        burst size is safe.
+        '''
+        return UARTStats(*map(int, self.modem.AT('$UARTSTAT?').split(',')))
+
+    def reset_uart_stats(self):
+        '''Reset all AT interface UART link statistics to zero.'''
+        self.modem.AT('$UARTSTATRST')
+
     def cw(self, freq: int, power: int, timeout: int):
         '''Start continuous carrier wave (CW) transmission.
 
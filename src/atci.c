@@ -3,11 +3,66 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <assert.h>
 #include "lpuart.h"
 #include "log.h"
 #include "halt.h"
 #include "system.h"
 #include "irq.h"
+#include "frame.h"
+
+
+// The number of slots in the hash table used to look up AT commands by name.
+// Must be a power of two larger than the number of commands.
+#ifndef ATCI_COMMAND_TABLE_SIZE
+#define ATCI_COMMAND_TABLE_SIZE 128
+#endif
+
+static_assert((ATCI_COMMAND_TABLE_SIZE & (ATCI_COMMAND_TABLE_SIZE - 1)) == 0,
+    "ATCI_COMMAND_TABLE_SIZE must be a power of two");
+static_assert(ATCI_COMMAND_TABLE_SIZE <= 256,
+    "ATCI_COMMAND_TABLE_SIZE must fit command indices into uint8_t");
+
+
+// The size of the queue of received AT command lines waiting for execution.
+// Must be large enough to hold the longest command line. The default size
+// holds the longest command line plus a few short ones.
+#ifndef ATCI_QUEUE_SIZE
+#define ATCI_QUEUE_SIZE 384
+#endif
+
+// Each queue entry consists of the index of the command plus one (zero if the
+// command is unknown), the length of the command name, the request id (zero in
+// text mode), and the NUL-terminated command line without the AT prefix.
+#define ATCI_QUEUE_ENTRY_SIZE(len) (3 + (len) + 1)
+
+// The maximum size of a decoded request frame and of a response frame in the
+// binary framed mode. Responses that do not fit into a single frame are split
+// across multiple frames.
+#ifndef ATCI_FRAME_RX_SIZE
+#define ATCI_FRAME_RX_SIZE 512
+#endif
+
+#ifndef ATCI_FRAME_TX_SIZE
+#define ATCI_FRAME_TX_SIZE 256
+#endif
+
+// The size of the queue of unsolicited result codes (URCs) waiting to be sent
+// to the host. Must be large enough to hold the longest URC, i.e., +RECV with
+// the largest hex-encoded payload. The default size holds such a +RECV plus
+// about a hundred bytes of shorter URCs.
+#ifndef ATCI_URC_QUEUE_SIZE
+#define ATCI_URC_QUEUE_SIZE 640
+#endif
+
+// Each URC queue entry consists of the priority, the length of the URC in
+// little-endian byte order, and the URC text.
+#define ATCI_URC_HEADER_SIZE 3
+
+// Each frame starts with the request id and the frame type and ends with a
+// CRC-16 checksum.
+#define ATCI_FRAME_HEADER_SIZE 2
+#define ATCI_FRAME_OVERHEAD (ATCI_FRAME_HEADER_SIZE + 2)
 
 
 enum parser_state
@@ -22,13 +77,43 @@ static struct
 {
     const atci_command_t *commands;
     size_t commands_length;
+
+    // Open-addressing hash table of command indices plus one, zero marks an
+    // empty slot. Built once by atci_init from the command table.
+    uint8_t command_table[ATCI_COMMAND_TABLE_SIZE];
+
     char rx_buffer[256];
     size_t rx_length;
     bool rx_error;
+    bool rx_nibble;
+    bool rx_overflow;
+    bool line_ready;
     bool aborted;
     enum parser_state parser_state;
 
-    char tmp[256];
+    char queue[ATCI_QUEUE_SIZE];
+    size_t queue_length;
+    bool barrier;
+
+    struct
+    {
+        char queue[ATCI_URC_QUEUE_SIZE];
+        size_t length;
+        bool capturing;         // Output goes to the URC opened at offset start
+        bool overflow;          // The open URC did not fit into the queue
+        size_t start;
+        atci_urc_priority_t priority;
+        size_t sent;            // Bytes of the first URC already sent
+        uint32_t dropped;
+    } urc;
+
+    struct
+    {
+        char *buffer;           // Output goes here instead of the host if set
+        size_t size;
+        size_t length;
+        bool overflow;
+    } capture;
 
     struct
     {
@@ -37,8 +122,90 @@ static struct
         void (*callback)(atci_data_status_t status, atci_param_t *param);
     } read_next_data;
 
+    struct
+    {
+        bool enabled;
+        bool change;            // A mode change requested by the current command
+        bool change_to;
+        bool executing;         // Output goes to the response of request id
+        uint8_t id;
+
+        uint8_t rx[ATCI_FRAME_RX_SIZE];
+        size_t rx_length;
+        bool rx_overflow;
+        uint8_t rx_id;          // The id of the last received request
+        const char *payload;    // The payload of the last received request
+        size_t payload_length;
+
+        // Also used by atci_printf as a bounce buffer in the text mode
+        uint8_t tx[ATCI_FRAME_TX_SIZE];
+        size_t tx_length;       // Not including the header
+    } frame;
+
 } state;
 
+static_assert(sizeof(state.queue) >= ATCI_QUEUE_ENTRY_SIZE(sizeof(state.rx_buffer)),
+    "ATCI_QUEUE_SIZE is too small for the longest command line");
+
+static_assert(ATCI_URC_QUEUE_SIZE >= ATCI_URC_HEADER_SIZE + 32 + 2 * 255 && ATCI_URC_QUEUE_SIZE <= 0xffff,
+    "ATCI_URC_QUEUE_SIZE is too small for the longest URC");
+
+
+// FNV-1a hash of an upper-case command name
+static uint32_t hash_step(uint32_t hash, char c)
+{
+    return (hash ^ (uint8_t)c) * 16777619u;
+}
+
+
+#define HASH_INIT 2166136261u
+
+
+static void build_command_table(void)
+{
+    uint32_t hash;
+    const char *c;
+
+    if (state.commands_length >= ATCI_COMMAND_TABLE_SIZE)
+        halt("Too many AT commands");
+
+    for (size_t i = 0; i < state.commands_length; i++) {
+        hash = HASH_INIT;
+        for (c = state.commands[i].command; *c; c++)
+            hash = hash_step(hash, *c);
+
+        while (state.command_table[hash & (ATCI_COMMAND_TABLE_SIZE - 1)]) hash++;
+        state.command_table[hash & (ATCI_COMMAND_TABLE_SIZE - 1)] = i + 1;
+    }
+}
+
+
+static const atci_command_t *find_command(const char *name, size_t length, uint32_t hash)
+{
+    const atci_command_t *cmd;
+    uint8_t i;
+
+    while ((i = state.command_table[hash & (ATCI_COMMAND_TABLE_SIZE - 1)])) {
+        cmd = state.commands + i - 1;
+        if (strncmp(cmd->command, name, length) == 0 && cmd->command[length] == '\0')
+            return cmd;
+        hash++;
+    }
+    return NULL;
+}
+
+
+const atci_command_t *atci_find_command(char *name, size_t length)
+{
+    uint32_t hash = HASH_INIT;
+
+    for (size_t i = 0; i < length; i++) {
+        name[i] = toupper(name[i]);
+        hash = hash_step(hash, name[i]);
+    }
+    return find_command(name, length, hash);
+}
+
 
 void atci_init(unsigned int baudrate, const atci_command_t *commands, int length)
 {
@@ -48,13 +215,341 @@ void atci_init(unsigned int baudrate, const atci_command_t *commands, int length
 
     state.commands = commands;
     state.commands_length = length;
+    build_command_table();
+}
+
+
+static inline size_t frame_space(void)
+{
+    return sizeof(state.frame.tx) - ATCI_FRAME_OVERHEAD - state.frame.tx_length;
+}
+
+
+static inline char *frame_tail(void)
+{
+    return (char *)state.frame.tx + ATCI_FRAME_HEADER_SIZE + state.frame.tx_length;
+}
+
+
+static void send_frame(atci_frame_type_t type)
+{
+    uint8_t *f = state.frame.tx;
+    size_t len = ATCI_FRAME_HEADER_SIZE + state.frame.tx_length;
+    uint16_t crc;
+
+    f[0] = type == ATCI_FRAME_URC ? 0 : state.frame.id;
+    f[1] = type;
+    crc = frame_crc16(FRAME_CRC_INIT, f, len);
+    f[len++] = crc & 0xff;
+    f[len++] = crc >> 8;
+
+    frame_encode(f, len, lpuart_write_blocking);
+    state.frame.tx_length = 0;
+}
+
+
+// Send the output collected so far when the frame buffer becomes full. The
+// output of a request is continued in the next frame.
+static void flush_frame(void)
+{
+    send_frame(state.frame.executing ? ATCI_FRAME_RESPONSE_MORE : ATCI_FRAME_URC);
+}
+
+
+// Unsolicited output generated outside of a request is collected in the frame
+// buffer and sent from atci_process. Make sure the main loop gets there.
+static void frame_written(void)
+{
+    if (state.frame.executing || state.frame.tx_length == 0) return;
+
+    uint32_t mask = disable_irq();
+    system_sleep_lock |= SYSTEM_MODULE_ATCI;
+    reenable_irq(mask);
+}
+
+
+static inline size_t urc_size(size_t offset)
+{
+    return (uint8_t)state.urc.queue[offset + 1] | (uint8_t)state.urc.queue[offset + 2] << 8;
+}
+
+
+// Remove the URC at the given offset from the queue
+static void remove_urc(size_t offset)
+{
+    size_t size = ATCI_URC_HEADER_SIZE + urc_size(offset);
+
+    state.urc.length -= size;
+    memmove(state.urc.queue + offset, state.urc.queue + offset + size, state.urc.length - offset);
+    if (state.urc.start > offset) state.urc.start -= size;
+}
+
+
+// Make room for @p length more bytes of the open URC. If the queue is full,
+// the oldest low-priority URCs are dropped until the data fits. High-priority
+// URCs that are already queued are never dropped.
+static bool reserve_urc(size_t length)
+{
+    size_t offset;
+
+    while (sizeof(state.urc.queue) - state.urc.length < length) {
+        // A URC that is being sent cannot be dropped anymore
+        offset = state.urc.sent ? ATCI_URC_HEADER_SIZE + urc_size(0) : 0;
+
+        while (offset < state.urc.start && state.urc.queue[offset] != ATCI_URC_LOW)
+            offset += ATCI_URC_HEADER_SIZE + urc_size(offset);
+
+        if (offset >= state.urc.start) return false;
+
+        remove_urc(offset);
+        state.urc.dropped++;
+    }
+    return true;
+}
+
+
+static char *urc_tail(size_t length)
+{
+    if (state.urc.overflow || !reserve_urc(length)) {
+        state.urc.overflow = true;
+        return NULL;
+    }
+    return state.urc.queue + state.urc.length;
+}
+
+
+// Output is captured either into the URC opened with atci_urc_begin, or into
+// a buffer provided with atci_capture_begin. A URC generated by a command whose
+// response is being captured still goes to the URC queue.
+static inline bool capturing(void)
+{
+    return state.urc.capturing || state.capture.buffer != NULL;
+}
+
+
+static char *capture_tail(size_t length)
+{
+    if (state.urc.capturing) return urc_tail(length);
+
+    if (state.capture.overflow || state.capture.size - state.capture.length < length) {
+        state.capture.overflow = true;
+        return NULL;
+    }
+    return state.capture.buffer + state.capture.length;
+}
+
+
+static void capture_commit(size_t length)
+{
+    if (state.urc.capturing) state.urc.length += length;
+    else state.capture.length += length;
+}
+
+
+static void capture_write(const char *data, size_t length)
+{
+    char *dst = capture_tail(length);
+    if (dst == NULL) return;
+
+    memcpy(dst, data, length);
+    capture_commit(length);
+}
+
+
+static size_t capture_vprintf(const char *format, va_list ap)
+{
+    va_list aq;
+    char *dst;
+    int rv;
+
+    va_copy(aq, ap);
+    rv = vsnprintf(NULL, 0, format, aq);
+    va_end(aq);
+    if (rv < 0) return 0;
+
+    dst = capture_tail(rv + 1);
+    if (dst == NULL) return 0;
+
+    vsnprintf(dst, rv + 1, format, ap);
+    capture_commit(rv);
+    return rv;
+}
+
+
+void atci_urc_begin(atci_urc_priority_t priority)
+{
+    state.urc.capturing = true;
+    state.urc.overflow = false;
+    state.urc.priority = priority;
+    state.urc.start = state.urc.length;
+
+    char *dst = urc_tail(ATCI_URC_HEADER_SIZE);
+    if (dst == NULL) return;
+
+    dst[0] = priority;
+    state.urc.length += ATCI_URC_HEADER_SIZE;
+}
+
+
+bool atci_urc_end(void)
+{
+    size_t length;
+
+    state.urc.capturing = false;
+
+    if (state.urc.overflow) {
+        state.urc.length = state.urc.start;
+        state.urc.dropped++;
+        log_warning("ATCI: URC queue full, URC dropped");
+        return false;
+    }
+
+    length = state.urc.length - state.urc.start - ATCI_URC_HEADER_SIZE;
+    state.urc.queue[state.urc.start + 1] = length & 0xff;
+    state.urc.queue[state.urc.start + 2] = length >> 8;
+    state.urc.start = state.urc.length;
+
+    // Make sure the main loop gets to atci_process to send the URC
+    uint32_t mask = disable_irq();
+    system_sleep_lock |= SYSTEM_MODULE_ATCI;
+    reenable_irq(mask);
+    return true;
+}
+
+
+void atci_capture_begin(char *buffer, size_t size)
+{
+    state.capture.buffer = buffer;
+    state.capture.size = size;
+    state.capture.length = 0;
+    state.capture.overflow = false;
+}
+
+
+int atci_capture_end(void)
+{
+    state.capture.buffer = NULL;
+    return state.capture.overflow ? -1 : (int)state.capture.length;
+}
+
+
+uint32_t atci_urc_dropped(void)
+{
+    return state.urc.dropped;
+}
+
+
+void atci_reset_urc_dropped(void)
+{
+    state.urc.dropped = 0;
+}
+
+
+// Send queued URCs to the host. Unless @p block is set, only as much data as
+// fits into the LPUART TX FIFO is sent and the rest is sent by a future call
+// once the TX DMA transfer has freed some space. URCs are sent in the order
+// in which they were generated, the priority only affects which URCs are
+// dropped when the queue is full.
+static void send_urcs(bool block)
+{
+    size_t length, n;
+    const char *p;
+
+    while (state.urc.length != 0 && !(state.urc.capturing && state.urc.start == 0)) {
+        length = urc_size(0);
+        p = state.urc.queue + ATCI_URC_HEADER_SIZE + state.urc.sent;
+
+        if (state.frame.enabled) {
+            // Each frame carries as much of the URC as fits. Send the frame
+            // only once its encoded form fits into the TX FIFO entirely.
+            n = length - state.urc.sent;
+            if (n > sizeof(state.frame.tx) - ATCI_FRAME_OVERHEAD)
+                n = sizeof(state.frame.tx) - ATCI_FRAME_OVERHEAD;
+
+            if (!block && cbuf_space(&lpuart_tx_fifo) < n + ATCI_FRAME_OVERHEAD + n / 254 + 2)
+                break;
+
+            memcpy(frame_tail(), p, n);
+            state.frame.tx_length = n;
+            send_frame(ATCI_FRAME_URC);
+        } else if (block) {
+            n = length - state.urc.sent;
+            lpuart_write_blocking(p, n);
+        } else {
+            n = lpuart_write(p, length - state.urc.sent);
+        }
+
+        // A URC is only ever sent partially if the TX FIFO is full. In the
+        // framed mode, it continues in the next frame.
+        state.urc.sent += n;
+        if (state.urc.sent < length) {
+            if (state.frame.enabled) continue;
+            break;
+        }
+
+        state.urc.sent = 0;
+        remove_urc(0);
+    }
+}
+
+
+// Finish sending the URC at the head of the queue if it has been sent only
+// partially. In the text mode, any other output must wait for that, or it would
+// end up in the middle of the URC.
+static void finish_urc(void)
+{
+    if (state.urc.sent == 0) return;
+
+    lpuart_write_blocking(state.urc.queue + ATCI_URC_HEADER_SIZE + state.urc.sent,
+        urc_size(0) - state.urc.sent);
+    state.urc.sent = 0;
+    remove_urc(0);
+}
+
+
+void atci_flush(void)
+{
+    if (state.frame.enabled && !state.frame.executing && state.frame.tx_length != 0)
+        send_frame(ATCI_FRAME_URC);
+
+    send_urcs(true);
+    lpuart_flush();
+}
+
+
+static void output(const char *data, size_t length)
+{
+    size_t n;
+
+    if (capturing()) {
+        capture_write(data, length);
+        return;
+    }
+
+    if (!state.frame.enabled) {
+        finish_urc();
+        lpuart_write_blocking(data, length);
+        return;
+    }
+
+    while (length) {
+        if (frame_space() == 0) flush_frame();
+
+        n = frame_space();
+        if (n > length) n = length;
+        memcpy(frame_tail(), data, n);
+        state.frame.tx_length += n;
+        data += n;
+        length -= n;
+    }
+    frame_written();
 }
 
 
 size_t atci_print(const char *message)
 {
     size_t len = strlen(message);
-    lpuart_write_blocking(message, len);
+    output(message, len);
     return len;
 }
 
@@ -62,42 +557,191 @@ size_t atci_print(const char *message)
 size_t atci_printf(const char *format, ...)
 {
     va_list ap;
-    size_t length;
+    int rv;
+    char *dst;
+    size_t length = 1;
+
+    if (capturing()) {
+        va_start(ap, format);
+        rv = capture_vprintf(format, ap);
+        va_end(ap);
+        return rv;
+    }
+
+    if (state.frame.enabled) {
+        // Format the message into the frame buffer. If it does not fit, send
+        // the output collected so far and try again with an empty buffer.
+        for (int i = 0; i < 2; i++) {
+            va_start(ap, format);
+            rv = vsnprintf(frame_tail(), frame_space() + 1, format, ap);
+            va_end(ap);
+            if (rv < 0) return 0;
+
+            if ((size_t)rv <= frame_space() || state.frame.tx_length == 0) break;
+            flush_frame();
+        }
+
+        if ((size_t)rv <= frame_space()) {
+            state.frame.tx_length += rv;
+            frame_written();
+            return rv;
+        }
+
+        // The message is longer than a frame, e.g., an AT$CONFIG line. Format
+        // it into the free space at the end of the URC queue and let output
+        // split it across frames. If queued URCs leave too little space, send
+        // them first. URC frames may be interleaved with response frames.
+        if (sizeof(state.urc.queue) - state.urc.length <= (size_t)rv)
+            send_urcs(true);
+
+        length = sizeof(state.urc.queue) - state.urc.length;
+        dst = state.urc.queue + state.urc.length;
+        va_start(ap, format);
+        rv = vsnprintf(dst, length, format, ap);
+        va_end(ap);
+        if (rv < 0) return 0;
+
+        // Only messages longer than the URC queue are truncated
+        if ((size_t)rv >= length) rv = length - 1;
+        output(dst, rv);
+        return rv;
+    }
+
+    finish_urc();
+
+    // Try to format the message directly into the contiguous free space at the
+    // end of the TX FIFO. This is the common case and it requires no copying.
+    dst = lpuart_reserve(&length);
     va_start(ap, format);
-    length = vsnprintf(state.tmp, sizeof(state.tmp), format, ap);
+    rv = vsnprintf(dst, length, format, ap);
     va_end(ap);
+    if (rv < 0) return 0;
 
-    if (length > sizeof(state.tmp))
-        length = sizeof(state.tmp);
+    if ((size_t)rv < length) {
+        lpuart_commit(rv);
+        return rv;
+    }
 
-    lpuart_write_blocking(state.tmp, length);
-    return length;
+    // The message did not fit, most likely because the free space wraps around
+    // the end of the FIFO. Messages shorter than the frame TX buffer, which is
+    // unused in the text mode, are formatted there and copied into the FIFO.
+    if ((size_t)rv < sizeof(state.frame.tx)) {
+        va_start(ap, format);
+        vsnprintf((char *)state.frame.tx, sizeof(state.frame.tx), format, ap);
+        va_end(ap);
+        lpuart_write_blocking((char *)state.frame.tx, rv);
+        return rv;
+    }
+
+    // Longer messages, e.g., AT$CONFIG lines with long values, are formatted
+    // into the FIFO once enough contiguous space is available. This waits at
+    // most until the FIFO has drained, since lpuart_reserve then rewinds it.
+    // Messages longer than the FIFO are truncated, but no caller produces
+    // them.
+    length = (size_t)rv + 1;
+    if (length > lpuart_tx_fifo.size) length = lpuart_tx_fifo.size;
+
+    dst = lpuart_reserve(&length);
+    va_start(ap, format);
+    rv = vsnprintf(dst, length, format, ap);
+    va_end(ap);
+    if (rv < 0) return 0;
+
+    if ((size_t)rv >= length) rv = length - 1;
+    lpuart_commit(rv);
+    return rv;
 }
 
 
+// A table of pre-encoded hexadecimal representations of all byte values. The
+// table is stored in flash and lets the encoder emit two characters per input
+// byte with a single lookup.
+#define HEX_DIGIT(n) ((n) < 10 ? '0' + (n) : 'A' + (n) - 10)
+#define HEX_PAIR(b) { HEX_DIGIT((b) >> 4), HEX_DIGIT((b) & 0x0f) }
+#define HEX_PAIR4(b) HEX_PAIR(b), HEX_PAIR(b + 1), HEX_PAIR(b + 2), HEX_PAIR(b + 3)
+#define HEX_PAIR16(b) HEX_PAIR4(b), HEX_PAIR4(b + 4), HEX_PAIR4(b + 8), HEX_PAIR4(b + 12)
+#define HEX_PAIR64(b) HEX_PAIR16(b), HEX_PAIR16(b + 16), HEX_PAIR16(b + 32), HEX_PAIR16(b + 48)
+
+static const char hex_pairs[256][2] = {
+    HEX_PAIR64(0), HEX_PAIR64(64), HEX_PAIR64(128), HEX_PAIR64(192)
+};
+
+
 size_t atci_print_buffer_as_hex(const void *buffer, size_t length)
 {
-    char byte;
-    size_t on_write = 0;
+    const uint8_t *src = buffer, *end = src + length;
+    bool half = false;
+    size_t avail, n;
+    char *dst, *p;
+
+    if (capturing()) {
+        if ((p = capture_tail(length * 2)) == NULL) return 0;
+        capture_commit(length * 2);
+
+        while (src < end) {
+            *p++ = hex_pairs[*src][0];
+            *p++ = hex_pairs[*src++][1];
+        }
+        return length * 2;
+    }
 
-    for (size_t i = 0; i < length; i++) {
-        byte = ((char *)buffer)[i];
+    if (state.frame.enabled) {
+        while (src < end) {
+            if (frame_space() < 2) flush_frame();
+
+            n = frame_space() / 2;
+            if (n > (size_t)(end - src)) n = end - src;
+            p = frame_tail();
+            state.frame.tx_length += n * 2;
+
+            while (n--) {
+                *p++ = hex_pairs[*src][0];
+                *p++ = hex_pairs[*src++][1];
+            }
+        }
+        frame_written();
+        return length * 2;
+    }
+
+    // Encode the data directly into the TX FIFO, one contiguous span of free
+    // space at a time, so that payloads of any size can be emitted without an
+    // intermediate buffer. A span may end in the middle of an encoded byte. In
+    // that case, the low nibble is emitted at the beginning of the next span.
+    finish_urc();
+    while (src < end) {
+        avail = 1;
+        p = dst = lpuart_reserve(&avail);
+
+        if (half) {
+            *p++ = hex_pairs[*src++][1];
+            avail--;
+            half = false;
+        }
+
+        n = avail / 2;
+        if (n > (size_t)(end - src)) n = end - src;
+        avail -= n * 2;
+
+        while (n--) {
+            *p++ = hex_pairs[*src][0];
+            *p++ = hex_pairs[*src++][1];
+        }
 
-        char upper = (byte >> 4) & 0xf;
-        char lower = byte & 0x0f;
+        if (avail && src < end) {
+            *p++ = hex_pairs[*src][0];
+            half = true;
+        }
 
-        state.tmp[on_write++] = upper < 10 ? upper + '0' : upper - 10 + 'A';
-        state.tmp[on_write++] = lower < 10 ? lower + '0' : lower - 10 + 'A';
+        lpuart_commit(p - dst);
     }
 
-    lpuart_write_blocking(state.tmp, on_write);
-    return on_write;
+    return length * 2;
 }
 
 
 size_t atci_write(const char *buffer, size_t length)
 {
-    lpuart_write_blocking(buffer, length);
+    output(buffer, length);
     return length;
 }
 
@@ -211,6 +855,19 @@ bool atci_set_read_next_data(size_t length, atci_encoding_t encoding, void (*cal
 }
 
 
+void atci_set_framing(bool enabled)
+{
+    state.frame.change = true;
+    state.frame.change_to = enabled;
+}
+
+
+bool atci_framing_enabled(void)
+{
+    return state.frame.enabled;
+}
+
+
 void atci_abort_read_next_data(void)
 {
     state.aborted = true;
@@ -226,7 +883,7 @@ void atci_clac_action(atci_param_t *param)
     for (size_t i = 0; i < state.commands_length; i++)
         atci_printf("AT%s\r\n", state.commands[i].command);
 
-    lpuart_write_blocking(ATCI_OK, ATCI_OK_LEN);
+    atci_write(ATCI_OK, ATCI_OK_LEN);
 }
 
 
@@ -236,7 +893,7 @@ void atci_help_action(atci_param_t *param)
     for (size_t i = 0; i < state.commands_length; i++)
         atci_printf("AT%s %s\r\n", state.commands[i].command, state.commands[i].hint);
 
-    lpuart_write_blocking(ATCI_OK, ATCI_OK_LEN);
+    atci_write(ATCI_OK, ATCI_OK_LEN);
 }
 
 
@@ -244,6 +901,7 @@ static void finish_next_data(atci_data_status_t status)
 {
     state.read_next_data.length = 0;
     state.read_next_data.encoding = ATCI_ENCODING_BIN;
+    state.rx_nibble = false;
     state.rx_buffer[state.rx_length] = 0;
 
     if (state.read_next_data.callback != NULL) {
@@ -259,45 +917,81 @@ static void finish_next_data(atci_data_status_t status)
 }
 
 
-static void process_command(void)
+// Upper-case the command line and look up the command by name. The name ends
+// at the first '=', '?', or ' ' character. Its length is returned in cmd_len.
+static const atci_command_t *parse_command(char *name, size_t name_len, size_t *cmd_len)
 {
-    log_debug("ATCI: %s", state.rx_buffer);
+    uint32_t hash = HASH_INIT;
 
-    if (state.rx_length < 2) return;
-    if (state.rx_buffer[0] != 'A' && state.rx_buffer[0] != 'a') return;
-    if (state.rx_buffer[1] != 'T' && state.rx_buffer[1] != 't') return;
+    *cmd_len = name_len;
 
-    if (state.rx_length == 2) {
-        lpuart_write_blocking(ATCI_OK, ATCI_OK_LEN);
-        return;
-    }
-
-    state.rx_buffer[state.rx_length] = 0;
-
-    for(size_t i = 2; i < state.rx_length; i++)
-        switch(state.rx_buffer[i]) {
+    for(size_t i = 0; i < name_len; i++)
+        switch(name[i]) {
             case '=':
             case '?':
             case ' ':
+                if (*cmd_len == name_len) *cmd_len = i;
                 break;
 
             default:
-                state.rx_buffer[i] = toupper(state.rx_buffer[i]);
+                name[i] = toupper(name[i]);
+                if (*cmd_len == name_len) hash = hash_step(hash, name[i]);
                 break;
         }
 
+    return find_command(name, *cmd_len, hash);
+}
+
+
+// Move the complete command line from the RX buffer to the command queue.
+// Returns false if there is not enough space in the queue.
+static bool enqueue_command(void)
+{
+    const atci_command_t *cmd = NULL;
     char *name = state.rx_buffer + 2;
     size_t name_len = state.rx_length - 2;
+    size_t cmd_len = 0;
+    char *entry;
 
-    const atci_command_t *cmd;
-    size_t cmd_len;
-    for (size_t i = 0; i < state.commands_length; i++) {
-        cmd = state.commands + i;
-        cmd_len = strlen(cmd->command);
+    if (ATCI_QUEUE_ENTRY_SIZE(name_len) > sizeof(state.queue) - state.queue_length)
+        return false;
+
+    // A line that did not fit into the RX buffer is queued without a command
+    // so that it is answered with an error in order with the other commands.
+    if (!state.rx_overflow)
+        cmd = parse_command(name, name_len, &cmd_len);
+
+    entry = state.queue + state.queue_length;
+    entry[0] = cmd == NULL ? 0 : cmd - state.commands + 1;
+    entry[1] = cmd_len;
+    entry[2] = state.frame.rx_id;
+    memcpy(entry + 3, name, name_len);
+    entry[3 + name_len] = '\0';
+    state.queue_length += ATCI_QUEUE_ENTRY_SIZE(name_len);
+
+    // Commands with a space-separated parameter, e.g., AT+UTX, may be followed
+    // by payload data. Such data must not be parsed as AT commands, so parsing
+    // is suspended until the command has been executed. In the framed mode,
+    // the payload travels within the request frame. The frame buffer must not
+    // be overwritten until the request has been executed.
+    if (state.frame.enabled) {
+        if (state.frame.payload != NULL) state.barrier = true;
+    } else if (cmd != NULL && name[cmd_len] == ' ') {
+        state.barrier = true;
+    }
+
+    return true;
+}
 
-        if (name_len < cmd_len) continue;
-        if (strncmp(name, cmd->command, cmd_len) != 0) continue;
 
+static void dispatch_command(const atci_command_t *cmd, char *name, size_t name_len, size_t cmd_len)
+{
+    if (name_len == 0) {
+        atci_write(ATCI_OK, ATCI_OK_LEN);
+        return;
+    }
+
+    if (cmd != NULL) {
         if (cmd_len == name_len) {
             if (cmd->action != NULL) {
                 cmd->action(NULL);
@@ -336,33 +1030,99 @@ static void process_command(void)
         }
     }
 
-    lpuart_write_blocking(ATCI_UNKNOWN_CMD, ATCI_UKNOWN_CMD_LEN);
+    atci_write(ATCI_UNKNOWN_CMD, ATCI_UKNOWN_CMD_LEN);
+}
+
+
+
+// A table that maps ASCII characters to the values of hexadecimal digits. Valid
+// digits have the HEX_VALID bit set, so that a pair of characters can be
+// validated with a single AND of the two table entries.
+#define HEX_VALID 0x10
+
+static const uint8_t hex_values[256] = {
+    ['0'] = HEX_VALID | 0x0, ['1'] = HEX_VALID | 0x1, ['2'] = HEX_VALID | 0x2, ['3'] = HEX_VALID | 0x3,
+    ['4'] = HEX_VALID | 0x4, ['5'] = HEX_VALID | 0x5, ['6'] = HEX_VALID | 0x6, ['7'] = HEX_VALID | 0x7,
+    ['8'] = HEX_VALID | 0x8, ['9'] = HEX_VALID | 0x9,
+    ['A'] = HEX_VALID | 0xa, ['B'] = HEX_VALID | 0xb, ['C'] = HEX_VALID | 0xc,
+    ['D'] = HEX_VALID | 0xd, ['E'] = HEX_VALID | 0xe, ['F'] = HEX_VALID | 0xf,
+    ['a'] = HEX_VALID | 0xa, ['b'] = HEX_VALID | 0xb, ['c'] = HEX_VALID | 0xc,
+    ['d'] = HEX_VALID | 0xd, ['e'] = HEX_VALID | 0xe, ['f'] = HEX_VALID | 0xf
+};
+
+
+static size_t decode_hex(const char *data, size_t length)
+{
+    const uint8_t *src = (const uint8_t *)data, *end = src + length;
+    uint8_t *dst = (uint8_t *)state.rx_buffer + state.rx_length;
+    uint8_t hi, lo;
+    size_t n;
+
+    // Complete a byte whose high nibble arrived at the end of the previous span
+    if (state.rx_nibble) {
+        lo = hex_values[*src++];
+        if (!(lo & HEX_VALID)) {
+            state.rx_error = true;
+            return 1;
+        }
+        *dst++ |= lo & 0x0f;
+        state.rx_nibble = false;
+    }
+
+    n = (end - src) / 2;
+    if (n > state.read_next_data.length - (dst - (uint8_t *)state.rx_buffer))
+        n = state.read_next_data.length - (dst - (uint8_t *)state.rx_buffer);
+
+    while (n--) {
+        hi = hex_values[src[0]];
+        lo = hex_values[src[1]];
+
+        if (!(hi & lo & HEX_VALID)) {
+            // Consume the input up to and including the first invalid digit
+            src += (hi & HEX_VALID) ? 2 : 1;
+            state.rx_error = true;
+            goto out;
+        }
+
+        *dst++ = (hi << 4) | (lo & 0x0f);
+        src += 2;
+    }
+
+    // A single digit left at the end of the span is the high nibble of the
+    // next byte. The low nibble will arrive with the next span.
+    if (src < end && (size_t)(dst - (uint8_t *)state.rx_buffer) < state.read_next_data.length) {
+        hi = hex_values[*src++];
+        if (!(hi & HEX_VALID)) {
+            state.rx_error = true;
+            goto out;
+        }
+        *dst = hi << 4;
+        state.rx_nibble = true;
+    }
+
+out:
+    state.rx_length = dst - (uint8_t *)state.rx_buffer;
+    return src - (const uint8_t *)data;
 }
 
 
-static void process_data(char character)
+// Process a contiguous span of data sent after a command that expects a
+// payload. Returns the number of characters consumed. The characters that
+// follow the payload within the span are left for the AT command parser.
+static size_t process_data(const char *data, size_t length)
 {
-    int c;
-    static bool even = true;
+    size_t n;
 
     switch(state.read_next_data.encoding) {
         case ATCI_ENCODING_BIN:
-            state.rx_buffer[state.rx_length++] = character;
+            n = state.read_next_data.length - state.rx_length;
+            if (n > length) n = length;
+            memcpy(state.rx_buffer + state.rx_length, data, n);
+            state.rx_length += n;
             break;
 
         case ATCI_ENCODING_HEX:
-            c = hex2bin(character);
-            if (c < 0) {
-                state.rx_error = true;
-                break;
-            }
-            if (even) {
-                state.rx_buffer[state.rx_length] = c << 4;
-                even = false;
-            } else {
-                state.rx_buffer[state.rx_length++] |= c;
-                even = true;
-            }
+            n = decode_hex(data, length);
             break;
 
         default:
@@ -371,16 +1131,19 @@ static void process_data(char character)
     }
 
     if (state.read_next_data.length == state.rx_length || state.rx_error) {
-        even = true;
         finish_next_data(state.rx_error ? ATCI_DATA_ENCODING_ERROR : ATCI_DATA_OK);
         state.rx_error = false;
     }
+
+    return n;
 }
 
 
 static void reset(void)
 {
     state.rx_length = 0;
+    state.rx_overflow = false;
+    state.line_ready = false;
     state.parser_state = ATCI_START_STATE;
 }
 
@@ -395,11 +1158,6 @@ static int append_to_buffer(char c)
 
 static void process_character(char character)
 {
-    if (state.read_next_data.length != 0) {
-        process_data(character);
-        return;
-    }
-
     // Ignore LF characters, AT commands are terminated with CR
     if (character == '\n') return;
 
@@ -429,11 +1187,11 @@ static void process_character(char character)
         case ATCI_ATTENTION_STATE:
             if (character == '\r') {
                 state.rx_buffer[state.rx_length] = 0;
-                process_command();
-                reset();
+                state.line_ready = true;
             } else if (append_to_buffer(character) < 0) {
-                lpuart_write_blocking(ATCI_UNKNOWN_CMD, sizeof(ATCI_UNKNOWN_CMD) - 1);
-                reset();
+                state.rx_buffer[state.rx_length] = 0;
+                state.rx_overflow = true;
+                state.line_ready = true;
             }
             break;
 
@@ -444,35 +1202,240 @@ static void process_character(char character)
 }
 
 
+// Translate a request frame into an AT command line in the RX buffer. The
+// TEXT and HEX parameters are concatenated into the command line, the latter
+// hex-encoded, so that requests can be executed by the AT command handlers. A
+// PAYLOAD parameter is kept in the frame buffer and passed to the command at
+// execution time. Frames with an invalid checksum are dropped.
+static void process_frame(void)
+{
+    uint8_t *f = state.frame.rx;
+    int len = frame_decode(f, state.frame.rx_length);
+    uint8_t type, l;
+    const uint8_t *v;
+
+    if (len < ATCI_FRAME_OVERHEAD) goto invalid;
+    len -= 2;
+    if (frame_crc16(FRAME_CRC_INIT, f, len) != (f[len] | f[len + 1] << 8)) goto invalid;
+    if (f[1] != ATCI_FRAME_REQUEST) goto invalid;
+
+    reset();
+    append_to_buffer('A');
+    append_to_buffer('T');
+    state.frame.payload = NULL;
+    state.frame.payload_length = 0;
+
+    for (int i = ATCI_FRAME_HEADER_SIZE; i < len; i += 2 + l) {
+        if (i + 2 > len) goto invalid;
+        type = f[i];
+        l = f[i + 1];
+        v = f + i + 2;
+        if (i + 2 + l > len) goto invalid;
+
+        switch(type) {
+            case ATCI_TLV_TEXT:
+                for (int j = 0; j < l; j++)
+                    if (append_to_buffer(v[j]) < 0) state.rx_overflow = true;
+                break;
+
+            case ATCI_TLV_HEX:
+                for (int j = 0; j < l; j++)
+                    if (append_to_buffer(hex_pairs[v[j]][0]) < 0 ||
+                        append_to_buffer(hex_pairs[v[j]][1]) < 0)
+                        state.rx_overflow = true;
+                break;
+
+            case ATCI_TLV_PAYLOAD:
+                state.frame.payload = (const char *)v;
+                state.frame.payload_length = l;
+                break;
+
+            default:
+                // Ignore unknown parameters for forward compatibility
+                break;
+        }
+    }
+
+    state.frame.rx_id = f[0];
+    state.rx_buffer[state.rx_length] = 0;
+    state.line_ready = true;
+    return;
+
+invalid:
+    log_debug("ATCI: Dropping invalid frame");
+    reset();
+}
+
+
+// Collect COBS-encoded data up to the next frame delimiter. Returns the number
+// of bytes consumed.
+static size_t receive_frame(const char *data, size_t length)
+{
+    const char *d = memchr(data, FRAME_DELIMITER, length);
+    size_t n = d == NULL ? length : (size_t)(d - data);
+
+    if (!state.frame.rx_overflow) {
+        if (n > sizeof(state.frame.rx) - state.frame.rx_length) {
+            state.frame.rx_overflow = true;
+        } else {
+            memcpy(state.frame.rx + state.frame.rx_length, data, n);
+            state.frame.rx_length += n;
+        }
+    }
+
+    if (d == NULL) return n;
+
+    if (state.frame.rx_overflow) {
+        log_debug("ATCI: Dropping oversized frame");
+    } else if (state.frame.rx_length != 0) {
+        process_frame();
+    }
+
+    state.frame.rx_length = 0;
+    state.frame.rx_overflow = false;
+    return n + 1;
+}
+
+
+static void set_framing(bool enabled)
+{
+    state.frame.enabled = enabled;
+    state.frame.rx_length = 0;
+    state.frame.rx_overflow = false;
+    state.frame.rx_id = 0;
+    state.frame.payload = NULL;
+    state.frame.tx_length = 0;
+    reset();
+}
+
+
+// Execute the command at the head of the command queue and remove it from the
+// queue. Responses are thus generated in the order in which the commands were
+// received.
+static void execute_command(void)
+{
+    char *name = state.queue + 3;
+    size_t name_len = strlen(name);
+    size_t cmd_len = (uint8_t)state.queue[1];
+    size_t entry_size = ATCI_QUEUE_ENTRY_SIZE(name_len);
+    bool last = entry_size == state.queue_length;
+    const atci_command_t *cmd = NULL;
+
+    if (state.queue[0] != 0)
+        cmd = state.commands + (uint8_t)state.queue[0] - 1;
+
+    log_debug("ATCI: AT%s", name);
+
+    if (state.frame.enabled) {
+        if (state.frame.tx_length != 0) send_frame(ATCI_FRAME_URC);
+        state.frame.executing = true;
+        state.frame.id = state.queue[2];
+    }
+
+    dispatch_command(cmd, name, name_len, cmd_len);
+
+    if (state.frame.executing) {
+        // A request that carries a payload is always the last one in the queue
+        // (see enqueue_command). Its payload is passed to the command as is,
+        // regardless of the configured data format. A command that expects a
+        // payload which was not provided is aborted right away.
+        if (state.read_next_data.length != 0) {
+            if (last && state.frame.payload != NULL) {
+                state.read_next_data.encoding = ATCI_ENCODING_BIN;
+                process_data(state.frame.payload, state.frame.payload_length);
+            }
+            if (state.read_next_data.length != 0)
+                finish_next_data(ATCI_DATA_ABORTED);
+        }
+
+        send_frame(ATCI_FRAME_RESPONSE);
+        state.frame.executing = false;
+    }
+    if (last) state.frame.payload = NULL;
+
+    state.queue_length -= entry_size;
+    memmove(state.queue, state.queue + entry_size, state.queue_length);
+
+    if (state.frame.change) {
+        state.frame.change = false;
+        set_framing(state.frame.change_to);
+    }
+}
+
+
 void atci_process(void)
 {
     uint32_t masked;
     cbuf_view_t data;
+    size_t consumed;
 
     masked = disable_irq();
     system_sleep_lock &= ~SYSTEM_MODULE_ATCI;
     reenable_irq(masked);
 
+    // Send unsolicited output collected in the framed mode
+    if (state.frame.enabled && state.frame.tx_length != 0)
+        send_frame(ATCI_FRAME_URC);
+
+    // Send queued URCs without waiting for the host. If the TX FIFO fills up,
+    // the TX DMA complete interrupt wakes the main loop up to send the rest.
+    send_urcs(false);
+
     while (true) {
         if (state.aborted) {
             finish_next_data(ATCI_DATA_ABORTED);
             state.aborted = false;
         }
 
-        masked = disable_irq();
+        // Stop parsing input once the queue is full or once a command that may
+        // be followed by payload data has been queued. The remaining input
+        // stays in the RX FIFO until the queued commands have been executed.
+        if (state.line_ready) {
+            if (!enqueue_command()) break;
+            reset();
+        }
+        if (state.barrier) break;
+
+        // The RX FIFO is a single-producer single-consumer queue. The ISR may
+        // append more data while we process the view, but it never modifies
+        // the data the view refers to, so interrupts can stay enabled.
         cbuf_head(&lpuart_rx_fifo, &data);
-        reenable_irq(masked);
 
         if ((data.len[0] + data.len[1]) == 0) break;
 
-        for (size_t i = 0; i < data.len[0]; i++)
-            process_character((char)data.ptr[0][i]);
+        consumed = 0;
+        for (int i = 0; i < 2 && !state.line_ready; i++) {
+            const char *p = data.ptr[i], *end = p + data.len[i];
+
+            // Payload data is decoded in bulk, AT commands are parsed one
+            // character at a time.
+            while (p < end && !state.line_ready) {
+                if (state.frame.enabled)
+                    p += receive_frame(p, end - p);
+                else if (state.read_next_data.length != 0)
+                    p += process_data(p, end - p);
+                else
+                    process_character(*p++);
+            }
+            consumed += p - data.ptr[i];
+        }
+
+        lpuart_consume(consumed);
+    }
 
-        for (size_t i = 0; i < data.len[1]; i++)
-            process_character((char)data.ptr[1][i]);
+    // Execute at most one queued command per invocation so that the main loop
+    // gets to service the LoRaWAN MAC between commands. Keep the main loop
+    // spinning until the queue has been drained and the input parsed. A URC
+    // that has been sent only partially must not be interrupted by a response.
+    // Commands wait until the rest of it has been sent without blocking. Other
+    // output, e.g., from the completion of payload data, finishes the URC
+    // first (see finish_urc).
+    if (state.queue_length != 0 && state.read_next_data.length == 0 && state.urc.sent == 0) {
+        execute_command();
+        if (state.queue_length == 0) state.barrier = false;
 
         masked = disable_irq();
-        cbuf_consume(&lpuart_rx_fifo, data.len[0] + data.len[1]);
+        system_sleep_lock |= SYSTEM_MODULE_ATCI;
         reenable_irq(masked);
     }
 }
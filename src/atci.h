@@ -18,8 +18,6 @@
 #define ATCI_COMMAND_CLAC {"+CLAC", atci_clac_action, NULL, NULL, NULL, "List all supported AT commands"}
 #define ATCI_COMMAND_HELP {"$HELP", atci_help_action, NULL, NULL, NULL, "This help"}
 
-#define atci_flush lpuart_flush
-
 
 //! @brief AT param struct
 typedef struct
@@ -59,6 +57,46 @@ typedef enum
 } atci_encoding_t;
 
 
+//! @brief Frame types of the binary framed mode
+//!
+//! Each decoded frame consists of a request id, the frame type, a body, and a
+//! CRC-16 checksum (see frame.h). Responses carry the id of the request.
+//! Unsolicited messages, e.g., +EVENT, are sent with id zero.
+typedef enum
+{
+    ATCI_FRAME_REQUEST       = 0x01,  // Body: TLV parameters
+    ATCI_FRAME_URC           = 0x80,  // Body: unsolicited text output
+    ATCI_FRAME_RESPONSE      = 0x81,  // Body: text response, final part
+    ATCI_FRAME_RESPONSE_MORE = 0x82   // Body: text response, more follows
+} atci_frame_type_t;
+
+
+//! @brief Request parameter types of the binary framed mode
+//!
+//! Each parameter is encoded as a one-byte type, a one-byte length, and the
+//! value. TEXT and HEX parameters are concatenated into an AT command line
+//! without the AT prefix, e.g., TEXT "+APPKEY=" followed by HEX with the raw
+//! key. PAYLOAD carries raw data for commands such as AT+UTX.
+typedef enum
+{
+    ATCI_TLV_TEXT    = 0x01,
+    ATCI_TLV_HEX     = 0x02,
+    ATCI_TLV_PAYLOAD = 0x03
+} atci_tlv_type_t;
+
+
+//! @brief Priority of unsolicited result codes (URCs)
+//!
+//! When the URC queue is full, the oldest low-priority URCs are dropped to make
+//! room for new ones. High-priority URCs are only dropped if they do not fit
+//! into the queue even after all low-priority URCs have been dropped.
+typedef enum
+{
+    ATCI_URC_LOW  = 0,
+    ATCI_URC_HIGH = 1
+} atci_urc_priority_t;
+
+
 //! @brief Initialize
 //! @param[in] baudrate The baudrate to configure on the UART interface
 //! @param[in] commands
@@ -67,6 +105,13 @@ typedef enum
 void atci_init(unsigned int baudrate, const atci_command_t *commands, int length);
 
 
+//! @brief Look up a command by name in the table passed to atci_init
+//! @param[inout] name Command name without the AT prefix, upper-cased in place
+//! @param[in] length Length of the command name
+//! @return A pointer to the command or NULL if there is no such command
+const atci_command_t *atci_find_command(char *name, size_t length);
+
+
 //! @brief
 void atci_process(void);
 
@@ -137,6 +182,62 @@ bool atci_set_read_next_data(size_t length, atci_encoding_t encoding, void (*cal
 void atci_abort_read_next_data(void);
 
 
+//! @brief Enable or disable the binary framed mode
+//!
+//! The change takes effect once the response to the current command has been
+//! sent.
+//! @param[in] enabled true to switch to the framed mode, false for text mode
+void atci_set_framing(bool enabled);
+
+
+//! @brief Check whether the binary framed mode is enabled
+bool atci_framing_enabled(void);
+
+
+//! @brief Start an unsolicited result code (URC)
+//!
+//! Output written with atci_print, atci_printf, atci_write, and
+//! atci_print_buffer_as_hex until atci_urc_end is collected in the URC queue.
+//! Queued URCs are sent from atci_process as the host reads data, so that the
+//! caller, e.g., a LoRaMac callback, never waits for the host.
+//! @param[in] priority Priority of the URC
+void atci_urc_begin(atci_urc_priority_t priority);
+
+
+//! @brief Finish the URC started with atci_urc_begin
+//! @return true If the URC has been queued
+//! @return false If the URC has been dropped because the queue is full
+bool atci_urc_end(void);
+
+
+//! @brief Return the number of URCs dropped because the queue was full
+uint32_t atci_urc_dropped(void);
+
+
+//! @brief Reset the counter of dropped URCs
+void atci_reset_urc_dropped(void);
+
+
+//! @brief Capture output into a buffer instead of sending it to the host
+//!
+//! Output written with atci_print, atci_printf, atci_write, and
+//! atci_print_buffer_as_hex until atci_capture_end is stored in the buffer.
+//! This allows a command to run the handlers of other commands and post-process
+//! their responses.
+//! @param[in] buffer Pointer to destination buffer
+//! @param[in] size Size of the destination buffer
+void atci_capture_begin(char *buffer, size_t size);
+
+
+//! @brief Stop capturing output started with atci_capture_begin
+//! @return Number of bytes captured or -1 if the output did not fit
+int atci_capture_end(void);
+
+
+//! @brief Send all queued URCs and wait until all output has been transmitted
+void atci_flush(void);
+
+
 //! @brief Helper for clac action
 void atci_clac_action(atci_param_t *param);
 
@@ -2,33 +2,55 @@
 #include <string.h>
 
 
-static inline size_t min(size_t a, size_t b)
-{
-    return a < b ? a : b;
-}
+// The producer and the consumer may run concurrently, e.g., in an interrupt
+// handler and in the main loop. The producer must not publish a new write
+// index before the data has been copied into the buffer and the consumer must
+// not publish a new read index before the data has been copied out. The
+// acquire and release memory orderings below guarantee that. Both indices are
+// modified by one side only, so no read-modify-write operations are needed.
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
 
 
-static inline size_t space_left(volatile const cbuf_t *c)
+static inline size_t min(size_t a, size_t b)
 {
-    return c->max_length - c->length;
+    return a < b ? a : b;
 }
 
 
 void cbuf_init(volatile cbuf_t *c, void *buffer, size_t size)
 {
+    // Round the size down to the nearest power of two
+    while (size & (size - 1)) size &= size - 1;
+
     c->buffer = buffer;
-    c->max_length = size;
-    c->length = 0;
+    c->size = size;
+    c->mask = size - 1;
     c->read = 0;
     c->write = 0;
 }
 
 
+size_t cbuf_length(const volatile cbuf_t *c)
+{
+    return load_acquire(&c->write) - load_acquire(&c->read);
+}
+
+
+size_t cbuf_space(const volatile cbuf_t *c)
+{
+    return c->size - cbuf_length(c);
+}
+
+
 cbuf_view_t *cbuf_tail(const volatile cbuf_t *c, cbuf_view_t *v)
 {
-    size_t l = space_left(c);
-    v->ptr[0] = c->buffer + c->write;
-    v->len[0] = min(c->max_length - c->write, l);
+    size_t w = c->write;
+    size_t l = c->size - (w - load_acquire(&c->read));
+    size_t i = w & c->mask;
+
+    v->ptr[0] = c->buffer + i;
+    v->len[0] = min(c->size - i, l);
     v->ptr[1] = c->buffer;
     v->len[1] = l - v->len[0];
     return v;
@@ -50,13 +72,30 @@ size_t cbuf_copy_in(const cbuf_view_t *v, const void *data, size_t len)
 
 size_t cbuf_produce(volatile cbuf_t *c, size_t len)
 {
-    len = min(len, space_left(c));
-    c->write = (c->write + len) % c->max_length;
-    c->length += len;
+    size_t w = c->write;
+    len = min(len, c->size - (w - load_acquire(&c->read)));
+    store_release(&c->write, w + len);
     return len;
 }
 
 
+void *cbuf_reserve(volatile cbuf_t *c, size_t *len)
+{
+    cbuf_view_t t;
+    cbuf_tail(c, &t);
+    if (t.len[0] < *len || t.len[0] == 0) return NULL;
+
+    *len = t.len[0];
+    return t.ptr[0];
+}
+
+
+size_t cbuf_commit(volatile cbuf_t *c, size_t len)
+{
+    return cbuf_produce(c, len);
+}
+
+
 size_t cbuf_put(volatile cbuf_t *c, const void *data, size_t len)
 {
     cbuf_view_t t;
@@ -66,10 +105,14 @@ size_t cbuf_put(volatile cbuf_t *c, const void *data, size_t len)
 
 cbuf_view_t *cbuf_head(const volatile cbuf_t *c, cbuf_view_t *h)
 {
-    h->ptr[0] = c->buffer + c->read;
-    h->len[0] = min(c->max_length - c->read, c->length);
+    size_t r = c->read;
+    size_t l = load_acquire(&c->write) - r;
+    size_t i = r & c->mask;
+
+    h->ptr[0] = c->buffer + i;
+    h->len[0] = min(c->size - i, l);
     h->ptr[1] = c->buffer;
-    h->len[1] = c->length - h->len[0];
+    h->len[1] = l - h->len[0];
     return h;
 }
 
@@ -89,9 +132,9 @@ size_t cbuf_copy_out(void *buffer, const cbuf_view_t *v, size_t max_len)
 
 size_t cbuf_consume(volatile cbuf_t *c, size_t len)
 {
-    len = min(len, c->length);
-    c->read = (c->read + len) % c->max_length;
-    c->length -= len;
+    size_t r = c->read;
+    len = min(len, load_acquire(&c->write) - r);
+    store_release(&c->read, r + len);
     return len;
 }
 
@@ -7,14 +7,22 @@
 /*! @brief A fixed-size circular buffer backed by a contiguous memory block
  *
  * This data structure can be used to implement a fixed-size first-in first-out
- * (FIFO) or queue that can store up to @p max_length bytes.
+ * (FIFO) or queue that can store up to @p size bytes. The size of the memory
+ * block must be a power of two.
+ *
+ * The circular buffer is safe to be used by a single producer and a single
+ * consumer running concurrently, e.g., an interrupt handler and the main loop,
+ * without disabling interrupts. The producer only ever modifies the write
+ * index and the consumer only ever modifies the read index. Both indices are
+ * free-running and are wrapped into the memory block with a bit mask. The
+ * number of bytes stored in the buffer is the difference of the two indices.
  */
 typedef struct cbuf {
     char *buffer;
-    size_t max_length;  //! Maximum length of the circular buffer in bytes
-    size_t length;      //! The number of bytes stored in the circular buffer
-    size_t read;        //! The index of the first byte
-    size_t write;       //! The index of the first empty element (if length > 0)
+    size_t size;          //! Size of the memory block in bytes (a power of two)
+    size_t mask;          //! Bit mask used to wrap indices into the memory block
+    volatile size_t read;   //! Free-running index of the first byte (consumer)
+    volatile size_t write;  //! Free-running index of the first empty element (producer)
 } cbuf_t;
 
 
@@ -33,6 +41,9 @@ typedef struct cbuf_view {
 
 
 /*! @brief Initialize @p cbuf with the memory given in @p buffer
+ *
+ * The size of the memory buffer must be a power of two. If it is not, only the
+ * largest power of two that fits into @p size bytes will be used.
  *
  * @param[in] queue A pointer to the circular buffer to be initialized
  * @param[in] buffer A pointer to the memory buffer to back the circular buffer
@@ -41,13 +52,38 @@ typedef struct cbuf_view {
 void cbuf_init(volatile cbuf_t *cbuf, void *buffer, size_t size);
 
 
+/*! @brief Return the number of bytes stored in @p cbuf
+ *
+ * Thread-safe: yes (single producer, single consumer)
+ * Running time: constant
+ *
+ * @param[in] cbuf A pointer to the circular buffer
+ * @return The number of bytes stored in the circular buffer
+ */
+size_t cbuf_length(const volatile cbuf_t *cbuf);
+
+
+/*! @brief Return the number of bytes that can be appended to @p cbuf
+ *
+ * Thread-safe: yes (single producer, single consumer)
+ * Running time: constant
+ *
+ * @param[in] cbuf A pointer to the circular buffer
+ * @return The amount of free space in the circular buffer in bytes
+ */
+size_t cbuf_space(const volatile cbuf_t *cbuf);
+
+
 /*! @brief Return a view representing free space at the end of @p cbuf
  *
  * This function can be used to obtain a view to the empty space (if any) at the
  * end of the circular buffer. The view can be used to append data. The function
  * returns the same pointer that is passed to it via @p tail .
  *
- * Thread-safe: no
+ * Only the producer may invoke this function. The free space in the view can
+ * only grow (not shrink) while the view is held.
+ *
+ * Thread-safe: yes (single producer, single consumer)
  * Running time: constant
  *
  * @param[in] cbuf A pointer to the circular buffer
@@ -83,7 +119,9 @@ size_t cbuf_copy_in(const cbuf_view_t *tail, const void *data, size_t len);
  * the memory buffer returned by cbuf_tail. The function returns the real number
  * of bytes by which the circular buffer data was extended.
  *
- * Thread-safe: no
+ * Only the producer may invoke this function.
+ *
+ * Thread-safe: yes (single producer, single consumer)
  * Running time: constant
  *
  * @param[in] cbuf A pointer to the circular buffer
@@ -93,6 +131,46 @@ size_t cbuf_copy_in(const cbuf_view_t *tail, const void *data, size_t len);
 size_t cbuf_produce(volatile cbuf_t *cbuf, size_t len);
 
 
+/*! @brief Reserve contiguous free space at the end of @p cbuf
+ *
+ * This function returns a pointer to contiguous free space at the end of the
+ * circular buffer that the application can write data into directly, e.g.,
+ * with vsnprintf. At least @p *len bytes of contiguous space must be
+ * available, otherwise the function returns NULL. On success, @p *len is
+ * updated with the total size of the contiguous free space, which may be
+ * larger than requested. The reserved space does not wrap around. Once the
+ * data has been written, the application appends it to the circular buffer
+ * with cbuf_commit.
+ *
+ * Only the producer may invoke this function.
+ *
+ * Thread-safe: yes (single producer, single consumer)
+ * Running time: constant
+ *
+ * @param[in] cbuf A pointer to the circular buffer
+ * @param[inout] len Minimum number of bytes to reserve on input, the size of the reserved space on output
+ * @return A pointer to the reserved space or NULL if not enough contiguous space is available
+ */
+void *cbuf_reserve(volatile cbuf_t *cbuf, size_t *len);
+
+
+/*! @brief Append @p len bytes previously written into space obtained with cbuf_reserve
+ *
+ * The value of @p len must be less than or equal to the size of the space
+ * returned by the most recent invocation of cbuf_reserve.
+ *
+ * Only the producer may invoke this function.
+ *
+ * Thread-safe: yes (single producer, single consumer)
+ * Running time: constant
+ *
+ * @param[in] cbuf A pointer to the circular buffer
+ * @param[in] len The number of bytes to append
+ * @return The number of bytes appended
+ */
+size_t cbuf_commit(volatile cbuf_t *cbuf, size_t len);
+
+
 /*! @brief Put up to @p len bytes of @p data into @p cbuf
  *
  * Put up to @p len bytes from the memory buffer @p data to the circular buffer.
@@ -101,7 +179,9 @@ size_t cbuf_produce(volatile cbuf_t *cbuf, size_t len);
  * function returns the number of appended bytes. The data from @p data is
  * copied into the internal buffer.
  *
- * Thread-safe: no
+ * Only the producer may invoke this function.
+ *
+ * Thread-safe: yes (single producer, single consumer)
  * Running time: linear with @p size
  *
  * @param[in] cbuf A pointer to the circular buffer
@@ -117,7 +197,10 @@ size_t cbuf_put(volatile cbuf_t *cbuf, const void *data, size_t len);
  * This function can be used to obtain a view into the data stored in the
  * circular buffer. The function returns the pointer passed to it via @p head .
  *
- * Thread-safe: no
+ * Only the consumer may invoke this function. The data in the view can only
+ * grow (not shrink) while the view is held.
+ *
+ * Thread-safe: yes (single producer, single consumer)
  * Running time: constant
  *
  * @param[in] cbuf A pointer to the circular buffer
@@ -153,7 +236,9 @@ size_t cbuf_copy_out(void *buffer, const cbuf_view_t *head, size_t max_len);
  * function. The function returns the real number of bytes consumed from the
  * circular buffer.
  *
- * Thread-safe: no
+ * Only the consumer may invoke this function.
+ *
+ * Thread-safe: yes (single producer, single consumer)
  * Running time: constant
  *
  * @param[in] cbuf A pointer to the circular buffer
@@ -171,7 +256,9 @@ size_t cbuf_consume(volatile cbuf_t *cbuf, size_t len);
  * retrieved if there is not enough data in the circular buffer. The function
  * returns the number of bytes retrieved.
  *
- * Thread-safe: no
+ * Only the consumer may invoke this function.
+ *
+ * Thread-safe: yes (single producer, single consumer)
  * Running time: linear with @p size
  *
  * @param[in] cbuf A pointer to the circular buffer
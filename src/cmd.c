@@ -42,12 +42,29 @@ typedef enum cmd_errno {
     ERR_UNSUPPORTED   = -17,  // Not supported in the current band
     ERR_DUTYCYCLE     = -18,  // Cannot transmit due to duty cycling
     ERR_NO_CHANNEL    = -19,  // Channel unavailable due to LBT or error
-    ERR_TOO_MANY      = -20   // Too many link check requests
+    ERR_TOO_MANY      = -20,  // Too many link check requests
+    ERR_NO_DATA       = -21   // No downlink available in the mailbox
 } cmd_errno_t;
 
 
+// The size of the buffer for the response of a single setting command run by
+// AT$CONFIG. Longer values are left out of the AT$CONFIG? dump.
+#ifndef CMD_CONFIG_BUFFER_SIZE
+#define CMD_CONFIG_BUFFER_SIZE 384
+#endif
+
+
 static uint8_t port;
 static bool request_confirmation;
+
+// What to do with the payload received after AT+UTX, AT+CTX, AT$QTX, and
+// AT$FDATA
+static enum {
+    UPLINK_SEND,
+    UPLINK_QUEUE,
+    UPLINK_FRAGMENT
+} uplink_mode;
+
 static TimerEvent_t payload_timer;
 
 bool schedule_reset = false;
@@ -150,13 +167,14 @@ static uint8_t *find_key(KeyIdentifier_t id)
 
 static void get_uart(void)
 {
-    OK("%d,%d,%d,%d,%d", sysconf.uart_baudrate, 8, 1, 0, 0);
+    OK("%d,%d,%d,%d,%d", sysconf.uart_baudrate, 8, 1, 0, sysconf.uart_flowctl);
 }
 
 
 static void set_uart(atci_param_t *param)
 {
-    uint32_t v;
+    static const uint32_t fixed[] = { 8, 1, 0 };
+    uint32_t v, flowctl = sysconf.uart_flowctl;
     if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
 
     switch(v) {
@@ -164,10 +182,33 @@ static void set_uart(atci_param_t *param)
         case 9600:  break;
         case 19200: break;
         case 38400: break;
+        case 57600: break;
+        case 115200: break;
+        case 230400: break;
+        case 460800: break;
         default: abort(ERR_PARAM);
     }
 
+    // The baud rate can be optionally followed by data bits, stop bits,
+    // parity, and flow control. Only 8N1 framing is supported. Flow control
+    // is 0 (none) or 1 (RTS/CTS).
+    if (param->offset != param->length) {
+        for (unsigned int i = 0; i < ARRAY_LEN(fixed); i++) {
+            uint32_t w;
+            if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+            if (!atci_param_get_uint(param, &w) || w != fixed[i]) abort(ERR_PARAM);
+        }
+
+        if (param->offset != param->length) {
+            if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+            if (!atci_param_get_uint(param, &flowctl) || flowctl > 1) abort(ERR_PARAM);
+        }
+
+        if (param->offset != param->length) abort(ERR_PARAM_NO);
+    }
+
     sysconf.uart_baudrate = v;
+    sysconf.uart_flowctl = flowctl;
     sysconf_modified = true;
 
     OK_();
@@ -1089,8 +1130,32 @@ static void transmit(atci_data_status_t status, atci_param_t *param)
         abort(ERR_PARAM);
     }
 
-    abort_on_error(lrw_send(port, param->txt, param->length, request_confirmation));
-    OK_();
+    switch (uplink_mode) {
+        case UPLINK_QUEUE: {
+            uint32_t handle;
+            if (lrw_queue_uplink(port, param->txt, param->length, request_confirmation, &handle) < 0)
+                abort(ERR_BUSY);
+            OK("%lu", handle);
+            break;
+        }
+
+        case UPLINK_FRAGMENT: {
+            // Unlike a single uplink, an incomplete chunk would corrupt the
+            // fragmented payload
+            if (status == ATCI_DATA_ABORTED) abort(ERR_PARAM);
+            int length = lrw_frag_append(param->txt, param->length);
+            if (length < 0) abort(ERR_PAYLOAD_LONG);
+            OK("%d", length);
+            break;
+        }
+
+        default:
+            abort_on_error(lrw_send(port, param->txt, param->length, request_confirmation));
+            // The original Type ABZ firmware responds with a plain +OK
+            if (sysconf.uplink_handles) OK("%lu", lrw_uplink_handle());
+            else OK_();
+            break;
+    }
 }
 
 
@@ -1115,6 +1180,7 @@ static void utx(atci_param_t *param)
     TimerStart(&payload_timer);
 
     request_confirmation = false;
+    uplink_mode = UPLINK_SEND;
     if (!atci_set_read_next_data(size,
         sysconf.data_format == 1 ? ATCI_ENCODING_HEX : ATCI_ENCODING_BIN, transmit))
         abort(ERR_PAYLOAD_LONG);
@@ -1234,6 +1300,148 @@ static void pctx(atci_param_t *param)
 }
 
 
+// AT$QTX <port>,<confirmed>,<size> queues an uplink. The modem sends queued
+// uplinks as soon as the duty cycle permits and reports each with +QTX.
+static void qtx(atci_param_t *param)
+{
+    if (param == NULL) abort(ERR_PARAM_NO);
+    int p = parse_port(param);
+    if (p < 0) abort(ERR_PARAM);
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    uint32_t confirmed;
+    if (!atci_param_get_uint(param, &confirmed) || confirmed > 1) abort(ERR_PARAM);
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    utx(param);
+    port = p;
+    request_confirmation = confirmed;
+    uplink_mode = UPLINK_QUEUE;
+}
+
+
+static void get_qtx(void)
+{
+    OK("%u", lrw_queued_uplinks());
+}
+
+
+static void fdata(atci_param_t *param)
+{
+    utx(param);
+    uplink_mode = UPLINK_FRAGMENT;
+}
+
+
+static void get_fdata(void)
+{
+    unsigned int id;
+    size_t sent, length;
+
+    lrw_frag_status(&id, &sent, &length);
+    OK("%u", length);
+}
+
+
+static void ftx(atci_param_t *param)
+{
+    if (param == NULL) abort(ERR_PARAM_NO);
+    int p = parse_port(param);
+    if (p < 0) abort(ERR_PARAM);
+
+    if (!atci_param_is_comma(param)) abort(ERR_PARAM);
+
+    uint32_t confirmed;
+    if (!atci_param_get_uint(param, &confirmed) || confirmed > 1) abort(ERR_PARAM);
+
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    int id = lrw_frag_send(p, confirmed);
+    if (id < 0) abort(ERR_BUSY);
+    OK("%d", id);
+}
+
+
+static void get_ftx(void)
+{
+    unsigned int id;
+    size_t sent, length;
+
+    lrw_frag_status(&id, &sent, &length);
+    OK("%u,%u,%u", id, sent, length);
+}
+
+
+static void cancel_ftx(atci_param_t *param)
+{
+    if (param != NULL) abort(ERR_PARAM);
+    lrw_frag_cancel();
+    OK_();
+}
+
+
+static void get_handles(void)
+{
+    OK("%d", sysconf.uplink_handles);
+}
+
+
+static void set_handles(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v > 1) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.uplink_handles = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_txdone(void)
+{
+    OK("%d", sysconf.txdone_urc);
+}
+
+
+static void set_txdone(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v > 1) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.txdone_urc = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_aggr(void)
+{
+    OK("%u", sysconf.aggregation_window);
+}
+
+
+static void set_aggr(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v > UINT16_MAX) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.aggregation_window = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
 static void cw(atci_param_t *param)
 {
     uint32_t freq, timeout;
@@ -2021,6 +2229,96 @@ static void set_cert(atci_param_t *param)
 }
 
 
+static void get_frame(void)
+{
+    OK("%d", atci_framing_enabled());
+}
+
+
+static void set_frame(atci_param_t *param)
+{
+    int enabled = parse_enabled(param);
+    if (enabled == -1) abort(ERR_PARAM);
+
+    // The response is sent in the current mode, the new mode applies to the
+    // following commands.
+    atci_set_framing(enabled);
+    OK_();
+}
+
+
+static void get_mailbox(void)
+{
+    OK("%d", sysconf.mailbox_depth);
+}
+
+
+static void set_mailbox(atci_param_t *param)
+{
+    uint32_t v;
+
+    if (!atci_param_get_uint(param, &v)) abort(ERR_PARAM);
+    if (v > 255) abort(ERR_PARAM);
+    if (param->offset != param->length) abort(ERR_PARAM_NO);
+
+    sysconf.mailbox_depth = v;
+    sysconf_modified = true;
+    OK_();
+}
+
+
+static void get_recv(void)
+{
+    OK("%u,%lu", lrw_mailbox_count(), lrw_mailbox_dropped());
+}
+
+
+// Return the oldest downlink from the mailbox without removing it. The payload
+// is always hex-encoded so that the response remains a single line.
+static void recv_mailbox(atci_param_t *param)
+{
+    if (param != NULL) abort(ERR_PARAM);
+
+    const lrw_downlink_t *d = lrw_mailbox_peek();
+    if (d == NULL) abort(ERR_NO_DATA);
+
+    TimerTime_t now = rtc_tick2ms(rtc_get_timer_value());
+    atci_printf("+OK=%d,%d,%d,%lu,%lu,", d->port, d->rssi, d->snr, d->fcnt, now - d->time);
+    atci_print_buffer_as_hex(d->data, d->length);
+    EOL();
+}
+
+
+static void drop_mailbox(atci_param_t *param)
+{
+    if (param != NULL) abort(ERR_PARAM);
+    if (lrw_mailbox_drop() != 0) abort(ERR_NO_DATA);
+    OK_();
+}
+
+
+static void get_uartstat(void)
+{
+    lpuart_stats_t s;
+    lpuart_get_stats(&s);
+
+    OK("%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu",
+        s.rx_bytes, s.tx_bytes, s.rx_dropped,
+        s.parity_errors, s.framing_errors, s.noise_errors, s.overruns,
+        s.rx_peak, s.tx_peak, s.tx_blocked_ms, atci_urc_dropped());
+}
+
+
+static void reset_uartstat(atci_param_t *param)
+{
+    if (param != NULL) abort(ERR_PARAM);
+
+    lpuart_reset_stats();
+    atci_reset_urc_dropped();
+    OK_();
+}
+
+
 static void get_session(void)
 {
     MibRequestConfirm_t r;
@@ -2136,6 +2434,9 @@ void process_uart_wakeup(void) {
 
 #endif
 
+static void get_config(void);
+static void set_config(atci_param_t *param);
+
 static const atci_command_t cmds[] = {
     {"+UART",        NULL,    set_uart,         get_uart,         NULL, "Configure UART interface"},
     {"+VER",         NULL,    NULL,             get_version_comp, NULL, "Firmware version and build time"},
@@ -2208,6 +2509,20 @@ static const atci_command_t cmds[] = {
     {"$CM",          cm,      NULL,             NULL,             NULL, "Start continuous modulated FSK transmission"},
     {"$NVM",         nvm_userdata,   NULL,      NULL,             NULL, "Write / Read userdata to/from 64 bytes of NVM"},
     {"$APKACCESS",   protect_appkey, NULL,      NULL,             NULL, "Protect AppKey against read access"},
+    {"$FRAME",       NULL,    set_frame,        get_frame,        NULL, "Enable or disable binary framed host protocol"},
+    {"$UARTSTAT",    NULL,    NULL,             get_uartstat,     NULL, "Return UART link statistics"},
+    {"$MAILBOX",     NULL,    set_mailbox,      get_mailbox,      NULL, "Configure downlink mailbox depth (0: send +RECV)"},
+    {"$RECV",        recv_mailbox, NULL,        get_recv,         NULL, "Return the oldest downlink in the mailbox"},
+    {"$RECVDEL",     drop_mailbox, NULL,        NULL,             NULL, "Remove the oldest downlink from the mailbox"},
+    {"$QTX",         qtx,     NULL,             get_qtx,          NULL, "Queue uplink message for transmission"},
+    {"$FDATA",       fdata,   NULL,             get_fdata,        NULL, "Append data to the payload for fragmented transmission"},
+    {"$FTX",         ftx,     NULL,             get_ftx,          NULL, "Send the payload from AT$FDATA in fragments"},
+    {"$FTXDEL",      cancel_ftx, NULL,          NULL,             NULL, "Cancel fragmented transmission and discard payload"},
+    {"$HANDLES",     NULL,    set_handles,      get_handles,      NULL, "Tag uplink responses and +ACK/+NOACK with handles"},
+    {"$TXDONE",      NULL,    set_txdone,       get_txdone,       NULL, "Enable or disable +TXDONE uplink completion messages"},
+    {"$AGGR",        NULL,    set_aggr,         get_aggr,         NULL, "Configure queued uplink aggregation window (ms, 0: off)"},
+    {"$CONFIG",      NULL,    set_config,       get_config,       NULL, "Read or write all settings in one command"},
+    {"$UARTSTATRST", reset_uartstat, NULL,      NULL,             NULL, "Reset UART link statistics"},
 #if MKR1310 == 1
     {"$DISUART",     disable_uart,   NULL,      NULL,             NULL, "Disable UART"}, 
 #endif
@@ -2215,6 +2530,83 @@ static const atci_command_t cmds[] = {
     ATCI_COMMAND_HELP};
 
 
+// Responses of the setting commands run by AT$CONFIG are collected here
+static char config_buffer[CMD_CONFIG_BUFFER_SIZE];
+
+
+// Dump all settings, i.e., all commands that can be both read and written, as
+// one line per setting in the form <command>=<value>, e.g., +ADR=1. The lines
+// can be passed back to AT$CONFIG= to restore the settings, except for settings
+// with multiple entries, e.g., +RFPARAM and +MCAST, which are dumped in their
+// read format and must be written one entry at a time. Settings that cannot be
+// read, e.g., a protected AppKey, and values longer than
+// CMD_CONFIG_BUFFER_SIZE are left out.
+static void get_config(void)
+{
+    const size_t prefix = sizeof("+OK=") - 1, suffix = sizeof(ATCI_EOL) - 1;
+    int n;
+
+    for (size_t i = 0; i < ATCI_COMMANDS_LENGTH(cmds); i++) {
+        const atci_command_t *c = cmds + i;
+        if (c->read == NULL || c->set == NULL || c->read == get_config) continue;
+
+        atci_capture_begin(config_buffer, sizeof(config_buffer));
+        c->read();
+        n = atci_capture_end();
+
+        if (n < (int)(prefix + suffix) || memcmp(config_buffer, "+OK=", prefix) != 0)
+            continue;
+
+        atci_printf("%s=%.*s\r\n", c->command, n - (int)(prefix + suffix), config_buffer + prefix);
+    }
+
+    OK_();
+}
+
+
+// Apply multiple settings in the form <command>=<value>, separated by ';', by
+// running the set handler of each command, e.g., AT$CONFIG=+ADR=1;+DR=3. The
+// settings are applied in order. The first setting that fails stops the
+// processing and its error is returned; the settings before it remain applied.
+static void set_config(atci_param_t *param)
+{
+    char *p = param->txt + param->offset, *end = param->txt + param->length;
+    char *item, *value;
+    const atci_command_t *c;
+    int n;
+
+    if (p == end) abort(ERR_PARAM_NO);
+
+    while (p < end) {
+        item = p;
+        while (p < end && *p != ';') p++;
+        *p = '\0';
+
+        value = strchr(item, '=');
+        if (value == NULL) abort(ERR_PARAM);
+
+        c = atci_find_command(item, value - item);
+        if (c == NULL || c->set == NULL || c->set == set_config) abort(ERR_PARAM);
+
+        value++;
+        atci_param_t v = { .txt = value, .length = p - value, .offset = 0 };
+
+        atci_capture_begin(config_buffer, sizeof(config_buffer));
+        c->set(&v);
+        n = atci_capture_end();
+
+        if (n < 0) abort(ERR_PARAM);
+        if (n < (int)ATCI_OK_LEN || memcmp(config_buffer, ATCI_OK, ATCI_OK_LEN) != 0) {
+            atci_write(config_buffer, n);
+            return;
+        }
+        p++;
+    }
+
+    OK_();
+}
+
+
 void cmd_init(unsigned int baudrate)
 {
     atci_init(baudrate, cmds, ATCI_COMMANDS_LENGTH(cmds));
@@ -2223,11 +2615,42 @@ void cmd_init(unsigned int baudrate)
 
 void cmd_event(unsigned int type, unsigned int subtype)
 {
+    // Network events are informational, the host can tell the outcome of an
+    // uplink from other URCs, e.g., +ACK.
+    atci_urc_begin(type == CMD_EVENT_NETWORK ? ATCI_URC_LOW : ATCI_URC_HIGH);
     atci_printf("+EVENT=%d,%d" ATCI_EOL, type, subtype);
+    atci_urc_end();
 }
 
 
 void cmd_ans(unsigned int margin, unsigned int gwcnt)
 {
+    atci_urc_begin(ATCI_URC_LOW);
     atci_printf("+ANS=2,%d,%d" ATCI_EOL, margin, gwcnt);
+    atci_urc_end();
+}
+
+
+// Report the outcome of an uplink queued with AT$QTX: 0 if the uplink has been
+// sent (and acknowledged if confirmed), 1 if a confirmed uplink has not been
+// acknowledged, or a negative error code if the uplink could not be sent.
+void cmd_qtx(uint32_t handle, int status, uint32_t fcnt, bool acked)
+{
+    int result = status != 0 ? status2error(status) : !acked;
+
+    atci_urc_begin(ATCI_URC_HIGH);
+    atci_printf("+QTX=%lu,%lu,%d" ATCI_EOL, handle, fcnt, result);
+    atci_urc_end();
+}
+
+
+void cmd_ftx(unsigned int id, int status, size_t sent, size_t length, bool acked)
+{
+    int result = status != 0 ? status2error(status) : !acked;
+
+    // Progress reports are low priority since each one supersedes the previous
+    // one. The final report and failures are high priority.
+    atci_urc_begin(result == 0 && sent < length ? ATCI_URC_LOW : ATCI_URC_HIGH);
+    atci_printf("+FTX=%d,%u,%u,%d" ATCI_EOL, id, sent, length, result);
+    atci_urc_end();
 }
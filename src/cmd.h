@@ -47,6 +47,10 @@ void cmd_event(unsigned int type, unsigned subtype);
 
 void cmd_ans(unsigned int margin, unsigned int gwcnt);
 
+void cmd_qtx(uint32_t handle, int status, uint32_t fcnt, bool acked);
+
+void cmd_ftx(unsigned int id, int status, size_t sent, size_t length, bool acked);
+
 #define cmd_process atci_process
 #define cmd_print atci_print
 #define cmd_printf atci_printf
@@ -0,0 +1,107 @@
+#include "crc32.h"
+#include <string.h>
+
+#if defined(__ARM_ARCH) && !defined(CRC32_SOFTWARE)
+#include <stm/include/stm32l072xx.h>
+
+#define CRC32_POLYNOMIAL 0x04C11DB7UL
+
+
+// The Cortex-M0+ has no instruction to reverse the bits in a word
+static uint32_t reverse_bits(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555UL) | ((v & 0x55555555UL) << 1);
+    v = ((v >> 2) & 0x33333333UL) | ((v & 0x33333333UL) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fUL) | ((v & 0x0f0f0f0fUL) << 4);
+    return __builtin_bswap32(v);
+}
+
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+    uint32_t word;
+
+    RCC->AHBENR |= RCC_AHBENR_CRCEN;
+
+    // The peripheral shifts data MSB first. Reversing the bits of each input
+    // byte and of the output yields the reflected checksum. The internal
+    // register holds the checksum in the non-reflected form, thus the value to
+    // continue from needs to be reversed, too.
+    CRC->POL = CRC32_POLYNOMIAL;
+    CRC->INIT = reverse_bits(crc);
+    CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET;
+
+    // Feed whole words with the first byte in the most significant position so
+    // that the bytes are processed in memory order
+    for (; length >= sizeof(word); length -= sizeof(word), p += sizeof(word)) {
+        memcpy(&word, p, sizeof(word));
+        CRC->DR = __builtin_bswap32(word);
+    }
+
+    while (length--)
+        *(volatile uint8_t *)&CRC->DR = *p++;
+
+    return CRC->DR;
+}
+
+#else
+
+// Slice-by-4 lookup tables for the reflected polynomial 0xEDB88320. Entry i of
+// table k is the remainder of byte i followed by k zero bytes. The tables are
+// generated at compile time so that they are stored in flash rather than RAM.
+// The remainder is linear, thus each entry is the XOR of the entries for the
+// bits set in i. The BASISk lists hold the entries of table k for the bytes
+// 0x01, 0x02, 0x04, ..., 0x80.
+#define BASIS0 \
+    0x77073096UL, 0xee0e612cUL, 0x076dc419UL, 0x0edb8832UL, \
+    0x1db71064UL, 0x3b6e20c8UL, 0x76dc4190UL, 0xedb88320UL
+#define BASIS1 \
+    0x191b3141UL, 0x32366282UL, 0x646cc504UL, 0xc8d98a08UL, \
+    0x4ac21251UL, 0x958424a2UL, 0xf0794f05UL, 0x3b83984bUL
+#define BASIS2 \
+    0x01c26a37UL, 0x0384d46eUL, 0x0709a8dcUL, 0x0e1351b8UL, \
+    0x1c26a370UL, 0x384d46e0UL, 0x709a8dc0UL, 0xe1351b80UL
+#define BASIS3 \
+    0xb8bc6765UL, 0xaa09c88bUL, 0x8f629757UL, 0xc5b428efUL, \
+    0x5019579fUL, 0xa032af3eUL, 0x9b14583dUL, 0xed59b63bUL
+
+#define ENTRY_(i, b0, b1, b2, b3, b4, b5, b6, b7) ( \
+    ((i) & 0x01 ? (b0) : 0) ^ ((i) & 0x02 ? (b1) : 0) ^ \
+    ((i) & 0x04 ? (b2) : 0) ^ ((i) & 0x08 ? (b3) : 0) ^ \
+    ((i) & 0x10 ? (b4) : 0) ^ ((i) & 0x20 ? (b5) : 0) ^ \
+    ((i) & 0x40 ? (b6) : 0) ^ ((i) & 0x80 ? (b7) : 0))
+#define ENTRY(i, ...) ENTRY_(i, __VA_ARGS__)
+#define ENTRY4(i, ...) ENTRY(i, __VA_ARGS__), ENTRY(i + 1, __VA_ARGS__), \
+    ENTRY(i + 2, __VA_ARGS__), ENTRY(i + 3, __VA_ARGS__)
+#define ENTRY16(i, ...) ENTRY4(i, __VA_ARGS__), ENTRY4(i + 4, __VA_ARGS__), \
+    ENTRY4(i + 8, __VA_ARGS__), ENTRY4(i + 12, __VA_ARGS__)
+#define ENTRY64(i, ...) ENTRY16(i, __VA_ARGS__), ENTRY16(i + 16, __VA_ARGS__), \
+    ENTRY16(i + 32, __VA_ARGS__), ENTRY16(i + 48, __VA_ARGS__)
+#define TABLE(...) { ENTRY64(0, __VA_ARGS__), ENTRY64(64, __VA_ARGS__), \
+    ENTRY64(128, __VA_ARGS__), ENTRY64(192, __VA_ARGS__) }
+
+static const uint32_t table[4][256] = {
+    TABLE(BASIS0), TABLE(BASIS1), TABLE(BASIS2), TABLE(BASIS3)
+};
+
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+
+    // Process four bytes per iteration. Assemble the word byte by byte so that
+    // the result does not depend on the endianness or alignment.
+    for (; length >= 4; length -= 4, p += 4) {
+        crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        crc = table[3][crc & 0xff] ^ table[2][(crc >> 8) & 0xff] ^
+            table[1][(crc >> 16) & 0xff] ^ table[0][crc >> 24];
+    }
+
+    while (length--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+
+    return crc;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32 (IEEE 802.3) with the polynomial 0x04C11DB7 in the reflected form,
+ * i.e., the same checksum as computed by Crc32 from LoRaWAN/Utilities. The
+ * checksum is used to protect the data stored in NVM.
+ *
+ * On the STM32 target, the checksum is computed by the CRC peripheral. Other
+ * builds, e.g., host-side tests, use a slice-by-4 table. Define CRC32_SOFTWARE
+ * to use the table on the target as well. Both backends produce identical
+ * results.
+ */
+
+#define CRC32_INIT 0xffffffffUL
+
+
+/*! @brief Update a CRC-32 checksum
+ *
+ * The function does not apply the final XOR, invert the result to obtain the
+ * checksum. The hardware backend uses the CRC peripheral without locking, thus
+ * the function must not be used from interrupt handlers.
+ *
+ * @param[in] crc The checksum computed so far, start with CRC32_INIT
+ * @param[in] data Pointer to the data
+ * @param[in] length Length of the data in bytes
+ * @return Updated checksum
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length);
+
+#endif // __CRC32_H__
@@ -2,16 +2,35 @@
 #include <string.h>
 #include <LoRaWAN/Utilities/timeServer.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal_flash.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include "irq.h"
+#include "system.h"
 
 #define _EEPROM_BASE DATA_EEPROM_BASE
 #define _EEPROM_END  DATA_EEPROM_BANK2_END
 #define _EEPROM_IS_BUSY() ((FLASH->SR & FLASH_SR_BSY) != 0UL)
+#define _EEPROM_ERRORS (FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_SIZERR | FLASH_SR_NOTZEROERR | FLASH_SR_FWWERR)
+
+// State of the background write started with eeprom_write_async. The write
+// proceeds from the FLASH interrupt handler, the callback is invoked from
+// eeprom_process in the thread context.
+static struct {
+    volatile bool active;
+    volatile bool done;
+    bool success;
+    uint32_t address;
+    const uint8_t *buffer;
+    size_t length;
+    size_t i;
+    void (*callback)(bool success);
+} _job;
 
 static bool _eeprom_is_busy(TimerTime_t timeout);
 static void _eeprom_unlock(void);
 static void _eeprom_lock(void);
-static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t length);
+static bool _eeprom_write(uint32_t address, size_t *i, const uint8_t *buffer, size_t length);
+static bool _eeprom_job_next(void);
+static void _eeprom_job_finish(bool success);
 
 bool eeprom_write(uint32_t address, const void *buffer, size_t length)
 {
@@ -25,6 +44,13 @@ bool eeprom_write(uint32_t address, const void *buffer, size_t length)
         return false;
     }
 
+    // Wait for the background write to finish. It completes on its own from
+    // the FLASH interrupt.
+    while (_job.active)
+    {
+        continue;
+    }
+
     if (_eeprom_is_busy(50))
     {
         return false;
@@ -36,7 +62,13 @@ bool eeprom_write(uint32_t address, const void *buffer, size_t length)
 
     while (i < length)
     {
-        _eeprom_write(address, &i, (uint8_t *) buffer, length);
+        if (_eeprom_write(address, &i, (const uint8_t *) buffer, length))
+        {
+            while (_EEPROM_IS_BUSY())
+            {
+                continue;
+            }
+        }
     }
 
     _eeprom_lock();
@@ -52,6 +84,102 @@ bool eeprom_write(uint32_t address, const void *buffer, size_t length)
     return true;
 }
 
+bool eeprom_write_async(uint32_t address, const void *buffer, size_t length, void (*callback)(bool success))
+{
+    // Add EEPROM base offset to address
+    address += _EEPROM_BASE;
+
+    // If user attempts to write outside EEPROM area...
+    if ((address + length) > (_EEPROM_END + 1))
+    {
+        // Indicate failure
+        return false;
+    }
+
+    if (_job.active || _job.done || _EEPROM_IS_BUSY())
+    {
+        return false;
+    }
+
+    _job.address = address;
+    _job.buffer = buffer;
+    _job.length = length;
+    _job.i = 0;
+    _job.callback = callback;
+    _job.success = false;
+
+    _eeprom_unlock();
+
+    FLASH->SR = FLASH_SR_EOP | _EEPROM_ERRORS;
+    HAL_NVIC_SetPriority(FLASH_IRQn, 3, 0);
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+
+    uint32_t masked = disable_irq();
+
+    FLASH->PECR |= FLASH_PECR_EOPIE | FLASH_PECR_ERRIE;
+
+    // Programming must not be interrupted by the Stop mode, the low-power
+    // Sleep mode is fine and the FLASH interrupt wakes the MCU up.
+    system_stop_lock |= SYSTEM_MODULE_EEPROM;
+    _job.active = true;
+
+    // If nothing differs, finish right away. The callback still runs from
+    // eeprom_process, like for any other write.
+    if (!_eeprom_job_next())
+    {
+        _eeprom_job_finish(true);
+    }
+
+    reenable_irq(masked);
+    return true;
+}
+
+bool eeprom_write_pending(void)
+{
+    return _job.active || _job.done;
+}
+
+void eeprom_process(void)
+{
+    if (!_job.done)
+    {
+        return;
+    }
+
+    uint32_t masked = disable_irq();
+    system_sleep_lock &= ~SYSTEM_MODULE_EEPROM;
+    reenable_irq(masked);
+
+    _job.done = false;
+
+    if (_job.callback != NULL)
+    {
+        _job.callback(_job.success);
+    }
+}
+
+void FLASH_IRQHandler(void)
+{
+    uint32_t sr = FLASH->SR;
+
+    if (sr & _EEPROM_ERRORS)
+    {
+        FLASH->SR = sr & (_EEPROM_ERRORS | FLASH_SR_EOP);
+        _eeprom_job_finish(false);
+        return;
+    }
+
+    if (sr & FLASH_SR_EOP)
+    {
+        FLASH->SR = FLASH_SR_EOP;
+
+        if (!_eeprom_job_next())
+        {
+            _eeprom_job_finish(true);
+        }
+    }
+}
+
 const void *eeprom_mmap(uint32_t address, size_t length)
 {
     // Add EEPROM base offset to address
@@ -129,7 +257,7 @@ static void _eeprom_lock(void)
     reenable_irq(masked);
 }
 
-static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t length)
+static bool _eeprom_write(uint32_t address, size_t *i, const uint8_t *buffer, size_t length)
 {
     uint32_t addr = address + *i;
 
@@ -193,11 +321,37 @@ static bool _eeprom_write(uint32_t address, size_t *i, uint8_t *buffer, size_t l
         *i += 1;
     }
 
-    while (_EEPROM_IS_BUSY())
+    return write;
+}
+
+// Start programming the next word of the background write that differs from
+// the EEPROM contents. Returns false if there is nothing left to write.
+static bool _eeprom_job_next(void)
+{
+    while (_job.i < _job.length)
     {
-        continue;
+        if (_eeprom_write(_job.address, &_job.i, _job.buffer, _job.length))
+        {
+            return true;
+        }
     }
 
-    return write;
+    return false;
+}
+
+// Must be called with the FLASH interrupt masked, i.e., from the interrupt
+// handler or with interrupts disabled
+static void _eeprom_job_finish(bool success)
+{
+    FLASH->PECR &= ~(FLASH_PECR_EOPIE | FLASH_PECR_ERRIE);
+    _eeprom_lock();
+
+    _job.success = success;
+    _job.active = false;
+    _job.done = true;
+
+    // Keep the main loop running until eeprom_process has invoked the callback
+    system_stop_lock &= ~SYSTEM_MODULE_EEPROM;
+    system_sleep_lock |= SYSTEM_MODULE_EEPROM;
 }
 
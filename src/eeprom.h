@@ -14,6 +14,35 @@
 
 bool eeprom_write(uint32_t address, const void *buffer, size_t length);
 
+//! @brief Start writing buffer to EEPROM area in the background
+//!
+//! The write is driven by the FLASH end-of-operation interrupt, one word at a
+//! time, so the caller can continue (or sleep) while it is in progress. Words
+//! that already hold the desired value are skipped. The buffer must remain
+//! valid until the callback has been invoked. Only one write can be in
+//! progress at a time. Synchronous writes wait for it to finish.
+//! @param[in] address EEPROM start address (starts at 0)
+//! @param[in] buffer Pointer to source buffer
+//! @param[in] length Number of bytes to be written
+//! @param[in] callback Invoked from eeprom_process once the write has finished
+//! @return true If the write has been started
+//! @return false If another write is in progress or the range is invalid
+
+bool eeprom_write_async(uint32_t address, const void *buffer, size_t length, void (*callback)(bool success));
+
+//! @brief Check whether a background write is in progress
+//! @return true If a write started with eeprom_write_async has not finished
+//! or its callback has not been invoked yet
+
+bool eeprom_write_pending(void);
+
+//! @brief Invoke the callback of a finished background write
+//!
+//! Must be called from the main loop so that the callback runs in the thread
+//! context.
+
+void eeprom_process(void);
+
 //! @brief Read buffer from EEPROM area
 //! @param[in] address EEPROM start address (starts at 0)
 //! @param[out] buffer Pointer to destination buffer
@@ -0,0 +1,72 @@
+#include "frame.h"
+#include <stdbool.h>
+
+
+// A nibble-wise lookup table for the CRC-16/CCITT-FALSE polynomial 0x1021. The
+// table is a compromise between the code size of a full 256-entry table and
+// the speed of a bitwise implementation.
+static const uint16_t crc16_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
+
+
+uint16_t frame_crc16(uint16_t crc, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+
+    while (length--) {
+        crc = (crc << 4) ^ crc16_table[(crc >> 12) ^ (*p >> 4)];
+        crc = (crc << 4) ^ crc16_table[(crc >> 12) ^ (*p++ & 0x0f)];
+    }
+    return crc;
+}
+
+
+int frame_decode(uint8_t *buffer, size_t length)
+{
+    const uint8_t *src = buffer, *end = buffer + length;
+    uint8_t *dst = buffer;
+    uint8_t code;
+
+    while (src < end) {
+        code = *src++;
+        if (code == FRAME_DELIMITER || code - 1 > end - src) return -1;
+
+        for (uint8_t i = 1; i < code; i++)
+            *dst++ = *src++;
+
+        // A block shorter than the maximum is followed by a zero byte, unless
+        // it is the last block of the frame.
+        if (code != 0xff && src < end) *dst++ = 0;
+    }
+
+    return dst - buffer;
+}
+
+
+void frame_encode(const uint8_t *data, size_t length, void (*write)(const char *buffer, size_t length))
+{
+    const uint8_t *end = data + length;
+    const uint8_t *block;
+    bool more;
+    char code;
+
+    // Emit the frame as a sequence of blocks of up to 254 non-zero bytes, each
+    // prefixed with the block length plus one. Each block shorter than the
+    // maximum, except for the last one, implies a zero byte that follows it.
+    do {
+        block = data;
+        while (data < end && *data != 0 && data - block < 254) data++;
+
+        code = data - block + 1;
+        write(&code, 1);
+        write((const char *)block, data - block);
+
+        more = data < end;
+        if (more && *data == 0 && data - block < 254) data++;
+    } while (more);
+
+    code = FRAME_DELIMITER;
+    write(&code, 1);
+}
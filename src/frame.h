@@ -0,0 +1,50 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Helpers for the binary framed host protocol. Frames are encoded with
+ * Consistent Overhead Byte Stuffing (COBS) and delimited with a zero byte. The
+ * last two bytes of each decoded frame carry a CRC-16/CCITT-FALSE checksum of
+ * the preceding bytes in little-endian byte order.
+ */
+
+#define FRAME_DELIMITER 0x00
+#define FRAME_CRC_INIT  0xffff
+
+
+/*! @brief Update a CRC-16/CCITT-FALSE checksum
+ *
+ * @param[in] crc The checksum computed so far, start with FRAME_CRC_INIT
+ * @param[in] data Pointer to the data
+ * @param[in] length Length of the data in bytes
+ * @return Updated checksum
+ */
+uint16_t frame_crc16(uint16_t crc, const void *data, size_t length);
+
+
+/*! @brief Decode a COBS-encoded frame in place
+ *
+ * The frame must not include the delimiter.
+ *
+ * @param[inout] buffer Pointer to the encoded frame
+ * @param[in] length Length of the encoded frame in bytes
+ * @return Length of the decoded frame or -1 if the frame is malformed
+ */
+int frame_decode(uint8_t *buffer, size_t length);
+
+
+/*! @brief COBS-encode a frame and pass the result to a write function
+ *
+ * The encoded frame is passed to @p write in blocks of up to 255 bytes,
+ * followed by the delimiter.
+ *
+ * @param[in] data Pointer to the frame
+ * @param[in] length Length of the frame in bytes
+ * @param[in] write A function that writes encoded data, e.g., to a UART
+ */
+void frame_encode(const uint8_t *data, size_t length, void (*write)(const char *buffer, size_t length));
+
+#endif // __FRAME_H__
@@ -20,7 +20,7 @@ __attribute__((noreturn)) void halt(const char *msg)
         log_error("%s: %s\r\n", prefix, msg);
     }
 
-    lpuart_flush();
+    atci_flush();
 
     disable_irq();
 
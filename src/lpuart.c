@@ -1,6 +1,9 @@
 #include "lpuart.h"
+#include <assert.h>
+#include <string.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_dma.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_lpuart.h>
+#include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_ll_rcc.h>
 #include <stm/STM32L0xx_HAL_Driver/Inc/stm32l0xx_hal.h>
 #include "halt.h"
 #include "utils.h"
@@ -14,10 +17,56 @@
 #define LPUART_BUFFER_SIZE 512
 #endif
 
-#ifndef LPUART_DMA_BUFFER_SIZE
-#define LPUART_DMA_BUFFER_SIZE 64
+// The RX DMA channel writes directly into the memory of the RX FIFO. Each DMA
+// transfer covers one contiguous span of free space at the end of the FIFO, so
+// the channel never overwrites data the application has not consumed yet. New
+// data is published to the consumer from the IDLE, half-transfer, and
+// transfer-complete interrupts, i.e., up to half of the FIFO may have been
+// received but not published yet.
+//
+// With flow control enabled, RTS is deasserted once the free space in the RX
+// FIFO drops below LPUART_RTS_OFF_SPACE bytes and asserted again once it grows
+// to LPUART_RTS_ON_SPACE bytes. The space left when RTS is deasserted must hold
+// the unpublished data plus whatever the host sends before it reacts to RTS.
+#ifndef LPUART_RTS_OFF_SPACE
+#define LPUART_RTS_OFF_SPACE (LPUART_BUFFER_SIZE / 2 + 64)
 #endif
 
+#ifndef LPUART_RTS_ON_SPACE
+#define LPUART_RTS_ON_SPACE (LPUART_BUFFER_SIZE * 3 / 4)
+#endif
+
+// LPUART1 is clocked from the 32.768 kHz LSE oscillator at baud rates up to
+// LPUART_LSE_MAX_BAUDRATE. The LSE keeps running in Stop mode, so the
+// peripheral receives on its own and wakes the MCU up with the first complete
+// frame. Higher baud rates are clocked from HSI16.
+#ifndef LPUART_LSE_MAX_BAUDRATE
+#define LPUART_LSE_MAX_BAUDRATE 9600
+#endif
+
+// HSI16 is switched off in Stop mode and LPUART1 requests it on a start bit.
+// Above LPUART_HSI_WAKEUP_MAX_BAUDRATE, the oscillator does not start quickly
+// enough to sample the first bits of the frame, so we keep HSI16 running in
+// Stop mode at the cost of higher Stop mode consumption.
+#ifndef LPUART_HSI_WAKEUP_MAX_BAUDRATE
+#define LPUART_HSI_WAKEUP_MAX_BAUDRATE 57600
+#endif
+
+// The flow control pins: CTS is handled by the LPUART1 peripheral, RTS is a
+// plain GPIO output driven by the firmware (active low).
+#define CTS_PORT GPIOB
+#define CTS_PIN  GPIO_PIN_13
+#define RTS_PORT GPIOB
+#define RTS_PIN  GPIO_PIN_14
+
+// The TX and RX FIFOs are lock-free single-producer single-consumer circular
+// buffers which require the size of the backing memory to be a power of two.
+static_assert((LPUART_BUFFER_SIZE & (LPUART_BUFFER_SIZE - 1)) == 0,
+    "LPUART_BUFFER_SIZE must be a power of two");
+
+static_assert(LPUART_RTS_OFF_SPACE < LPUART_RTS_ON_SPACE && LPUART_RTS_ON_SPACE <= LPUART_BUFFER_SIZE,
+    "Invalid RTS flow control thresholds");
+
 
 static UART_HandleTypeDef port;
 
@@ -26,36 +75,106 @@ static __IO ITStatus tx_idle;
 static volatile size_t tx_len;
 volatile cbuf_t lpuart_tx_fifo;
 
-static unsigned char dma_buffer[LPUART_DMA_BUFFER_SIZE];
 static unsigned char rx_buffer[LPUART_BUFFER_SIZE];
+static volatile size_t rx_start; // FIFO write index where the RX DMA transfer started
+static volatile size_t rx_span;  // Length of the RX DMA transfer, zero if stopped
 volatile cbuf_t lpuart_rx_fifo;
 
+static bool flow_control;
+static volatile bool rts_asserted;
 
-// This function is invoked from the IRQ handler context
-static void enqueue(unsigned char *data, size_t len)
+static uint32_t clock_source = RCC_LPUART1CLKSOURCE_HSI;
+
+// The counters are updated from both the IRQ handlers and the main loop. The
+// main loop masks interrupts while updating them.
+static volatile lpuart_stats_t stats;
+
+
+// Deassert RTS if the RX FIFO is about to fill up. Invoked from the IRQ handler
+// context after new data has been stored in the RX FIFO.
+static void update_rts_off(void)
 {
-    size_t stored = cbuf_put(&lpuart_rx_fifo, data, len);
-    if (stored != len)
-        log_warning("lpuart: Read overrun, %d bytes discarded", len - stored);
+    if (flow_control && rts_asserted && cbuf_space(&lpuart_rx_fifo) < LPUART_RTS_OFF_SPACE) {
+        HAL_GPIO_WritePin(RTS_PORT, RTS_PIN, GPIO_PIN_SET);
+        rts_asserted = false;
+    }
 }
 
 
-// This function is invoked from the IRQ handler context
+// Assert RTS again once the application has drained enough data from the RX
+// FIFO. Invoked from the main loop after data has been consumed.
+static void update_rts_on(void)
+{
+    if (!flow_control || rts_asserted) return;
+
+    uint32_t masked = disable_irq();
+    if (!rts_asserted && cbuf_space(&lpuart_rx_fifo) >= LPUART_RTS_ON_SPACE) {
+        HAL_GPIO_WritePin(RTS_PORT, RTS_PIN, GPIO_PIN_RESET);
+        rts_asserted = true;
+    }
+    reenable_irq(masked);
+}
+
+
+// This function is invoked from the IRQ handler context. The DMA channel has
+// already stored the data in the RX FIFO memory, we only need to publish it by
+// moving the write index to the current DMA position.
 static void rx_callback(void)
 {
-    static size_t old_pos;
-    size_t pos;
+    size_t len;
 
-    pos = ARRAY_LEN(dma_buffer) - LL_DMA_GetDataLength(DMA1, LL_DMA_CHANNEL_6);
-    if (pos == old_pos) return;
+    if (rx_span == 0) return;
 
-    if (pos > old_pos) {
-        enqueue(&dma_buffer[old_pos], pos - old_pos);
-    } else {
-        enqueue(&dma_buffer[old_pos], ARRAY_LEN(dma_buffer) - old_pos);
-        if (pos > 0) enqueue(&dma_buffer[0], pos);
+    len = rx_start + rx_span - LL_DMA_GetDataLength(DMA1, LL_DMA_CHANNEL_6) - lpuart_rx_fifo.write;
+    if (len == 0) return;
+
+    // The DMA transfer only covers free space, so all of the data fits
+    cbuf_produce(&lpuart_rx_fifo, len);
+
+    stats.rx_bytes += len;
+    size_t queued = cbuf_length(&lpuart_rx_fifo);
+    if (queued > stats.rx_peak) stats.rx_peak = queued;
+
+    update_rts_off();
+}
+
+
+// Start a DMA transfer into the contiguous free space at the end of the RX
+// FIFO. If the FIFO is full, reception stops until the application consumes
+// some data. The LPUART peripheral discards bytes received in the meantime and
+// signals an overrun for each. Invoked from the IRQ handler context or with
+// interrupts masked.
+static void start_rx(void)
+{
+    cbuf_view_t v;
+
+    cbuf_tail(&lpuart_rx_fifo, &v);
+    rx_start = lpuart_rx_fifo.write;
+    rx_span = v.len[0];
+
+    if (rx_span == 0) {
+        log_warning("lpuart: RX FIFO full, reception stopped");
+
+        // The HAL disables the error interrupt at the end of each DMA transfer.
+        // Keep it enabled so that the discarded bytes are counted.
+        LL_LPUART_EnableIT_ERROR(LPUART1);
+        return;
     }
-    old_pos = pos;
+
+    if (HAL_UART_Receive_DMA(&port, (unsigned char *)v.ptr[0], rx_span) != HAL_OK)
+        rx_span = 0;
+}
+
+
+// Restart reception stopped by a full RX FIFO. Invoked from the main loop after
+// data has been consumed.
+static void resume_rx(void)
+{
+    if (rx_span) return;
+
+    uint32_t masked = disable_irq();
+    if (rx_span == 0) start_rx();
+    reenable_irq(masked);
 }
 
 
@@ -63,7 +182,16 @@ void lpuart_init(unsigned int baudrate)
 {
     cbuf_init(&lpuart_tx_fifo, tx_buffer, sizeof(tx_buffer));
     cbuf_init(&lpuart_rx_fifo, rx_buffer, sizeof(rx_buffer));
+    rx_span = 0;
     tx_idle = 1;
+    rts_asserted = true;
+
+    // The clock source must be known before HAL_UART_Init, which configures it
+    // in HAL_UART_MspInit and derives the baud rate divider from it.
+    clock_source = baudrate <= LPUART_LSE_MAX_BAUDRATE ? RCC_LPUART1CLKSOURCE_LSE : RCC_LPUART1CLKSOURCE_HSI;
+
+    if (baudrate > LPUART_HSI_WAKEUP_MAX_BAUDRATE) LL_RCC_HSI_EnableInStopMode();
+    else LL_RCC_HSI_DisableInStopMode();
 
     uint32_t masked = disable_irq();
 
@@ -73,7 +201,7 @@ void lpuart_init(unsigned int baudrate)
     port.Init.WordLength = UART_WORDLENGTH_8B;
     port.Init.StopBits = UART_STOPBITS_1;
     port.Init.Parity = UART_PARITY_NONE;
-    port.Init.HwFlowCtl = UART_HWCONTROL_NONE;
+    port.Init.HwFlowCtl = flow_control ? UART_HWCONTROL_CTS : UART_HWCONTROL_NONE;
 
     if (HAL_UART_Init(&port) != HAL_OK) goto error;
 
@@ -86,10 +214,11 @@ void lpuart_init(unsigned int baudrate)
     //
     LL_LPUART_DisableDMADeactOnRxErr(LPUART1);
 
-    // Disable overrun detection. If we are not fast enough at receiving data,
-    // let the new byte ovewrite the previous one without setting the overrun
-    // event. The application layer (ATCI) can deal with such errors.
-    LL_LPUART_DisableOverrunDetect(LPUART1);
+    // Enable overrun detection. If the DMA channel does not read a byte before
+    // the next one arrives, the new byte is discarded and the ORE flag is set.
+    // The error interrupt handler counts the event and clears the flag. The
+    // application layer (ATCI) can deal with the missing data.
+    LL_LPUART_EnableOverrunDetect(LPUART1);
 
     __HAL_UART_ENABLE(&port);
     uint32_t tickstart = HAL_GetTick();
@@ -100,8 +229,8 @@ void lpuart_init(unsigned int baudrate)
     UART_WakeUpTypeDef wake = { .WakeUpEvent = LL_LPUART_WAKEUP_ON_RXNE };
     HAL_UARTEx_StopModeWakeUpSourceConfig(&port, wake);
 
-    if (HAL_UART_Receive_DMA(&port, dma_buffer, ARRAY_LEN(dma_buffer)) != HAL_OK)
-        goto error;
+    start_rx();
+    if (rx_span == 0) goto error;
 
     HAL_UARTEx_EnableStopMode(&port);
 
@@ -115,10 +244,10 @@ void lpuart_init(unsigned int baudrate)
     // don't, e.g., during heavy memory bus activity (writes to EEPROM).
     LL_LPUART_DisableIT_RXNE(LPUART1);
 
-    // Disable framing, noise, and overrun interrupt generation. We don't want
-    // those errors to stop DMA transfers. We simply ignore such errors and let
-    // the ATCI recover at the application layer.
-    LL_LPUART_DisableIT_ERROR(LPUART1);
+    // Enable framing, noise, and overrun interrupt generation so that each
+    // error is counted in the link statistics. DMA transfers are not stopped
+    // on errors (see above) and the ATCI recovers at the application layer.
+    LL_LPUART_EnableIT_ERROR(LPUART1);
 
     reenable_irq(masked);
     return;
@@ -149,6 +278,23 @@ static void init_gpio(void)
     gpio.Alternate = GPIO_AF6_LPUART1;
     gpio.Pull = GPIO_PULLUP;
     HAL_GPIO_Init(GPIOA, &gpio);
+
+    if (flow_control) {
+        __HAL_RCC_GPIOB_CLK_ENABLE();
+
+        // Let the peripheral transmit if the host leaves CTS unconnected
+        gpio.Pin = CTS_PIN;
+        gpio.Alternate = GPIO_AF4_LPUART1;
+        gpio.Pull = GPIO_PULLDOWN;
+        HAL_GPIO_Init(CTS_PORT, &gpio);
+
+        HAL_GPIO_WritePin(RTS_PORT, RTS_PIN, rts_asserted ? GPIO_PIN_RESET : GPIO_PIN_SET);
+        gpio.Pin = RTS_PIN;
+        gpio.Mode = GPIO_MODE_OUTPUT_PP;
+        gpio.Pull = GPIO_NOPULL;
+        gpio.Alternate = 0;
+        HAL_GPIO_Init(RTS_PORT, &gpio);
+    }
 }
 
 
@@ -166,18 +312,28 @@ static void deinit_gpio(void)
 
     gpio.Pin = GPIO_PIN_3;
     HAL_GPIO_Init(GPIOA, &gpio);
+
+    if (flow_control) {
+        __HAL_RCC_GPIOB_CLK_ENABLE();
+        gpio.Pin = CTS_PIN | RTS_PIN;
+        HAL_GPIO_Init(RTS_PORT, &gpio);
+    }
 }
 
 
 void lpuart_disable(void) {
     lpuart_flush();
+    uint32_t masked = disable_irq();
     HAL_UART_DMAPause(&port);
+    reenable_irq(masked);
     deinit_gpio();
 }
 
 void lpuart_enable() {
     init_gpio();
+    uint32_t masked = disable_irq();
     HAL_UART_DMAResume(&port);
+    reenable_irq(masked);
 }
 
 void HAL_UART_MspInit(UART_HandleTypeDef *port)
@@ -189,10 +345,10 @@ void HAL_UART_MspInit(UART_HandleTypeDef *port)
     /* Enable LPUART clock */
     __LPUART1_CLK_ENABLE();
 
-    /* select LPUART clock source */
+    /* select LPUART clock source, see lpuart_init */
     RCC_PeriphCLKInitTypeDef clock = {
         .PeriphClockSelection = RCC_PERIPHCLK_LPUART1,
-        .Lpuart1ClockSelection = RCC_LPUART1CLKSOURCE_HSI
+        .Lpuart1ClockSelection = clock_source
     };
     HAL_RCCEx_PeriphCLKConfig(&clock);
 
@@ -224,7 +380,7 @@ void HAL_UART_MspInit(UART_HandleTypeDef *port)
         .Init = {
             .Direction           = DMA_PERIPH_TO_MEMORY,
             .Priority            = DMA_PRIORITY_LOW,
-            .Mode                = DMA_CIRCULAR,
+            .Mode                = DMA_NORMAL,
             .Request             = DMA_REQUEST_5,
             .PeriphDataAlignment = DMA_PDATAALIGN_BYTE,
             .MemDataAlignment    = DMA_MDATAALIGN_BYTE,
@@ -267,20 +423,19 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef *port)
 }
 
 
-size_t lpuart_write(const char *buffer, size_t length)
+// Start a new DMA transfer from the TX FIFO unless one is already in progress
+static void start_tx(void)
 {
-    uint32_t masked = disable_irq();
     cbuf_view_t v;
 
-    cbuf_tail(&lpuart_tx_fifo, &v);
-    reenable_irq(masked);
-
-    size_t written = cbuf_copy_in(&v, buffer, length);
+    // Starting a new DMA transfer must not race with the TX complete callback
+    // which may start one too.
+    uint32_t masked = disable_irq();
 
-    masked = disable_irq();
-    cbuf_produce(&lpuart_tx_fifo, written);
+    size_t queued = cbuf_length(&lpuart_tx_fifo);
+    if (queued > stats.tx_peak) stats.tx_peak = queued;
 
-    if (tx_idle && lpuart_tx_fifo.length > 0) {
+    if (tx_idle && cbuf_length(&lpuart_tx_fifo) > 0) {
         tx_idle = 0;
         system_stop_lock |= SYSTEM_MODULE_LPUART_TX;
 
@@ -295,10 +450,71 @@ size_t lpuart_write(const char *buffer, size_t length)
     }
 
     reenable_irq(masked);
+}
+
+
+size_t lpuart_write(const char *buffer, size_t length)
+{
+    cbuf_view_t v;
+
+    // The main loop is the only producer and the DMA TX complete callback is
+    // the only consumer of the TX FIFO, so no interrupt masking is necessary
+    // to append data to the FIFO.
+    cbuf_tail(&lpuart_tx_fifo, &v);
+    size_t written = cbuf_copy_in(&v, buffer, length);
+    cbuf_produce(&lpuart_tx_fifo, written);
+
+    start_tx();
     return written;
 }
 
 
+// Account for the time since @p start spent waiting for a full TX FIFO. The
+// SysTick keeps running, since the pending DMA transfer prevents Stop mode.
+static void add_blocked_time(uint32_t start)
+{
+    uint32_t masked = disable_irq();
+    stats.tx_blocked_ms += HAL_GetTick() - start;
+    reenable_irq(masked);
+}
+
+
+char *lpuart_reserve(size_t *length)
+{
+    uint32_t masked, start = HAL_GetTick();
+    bool blocked = false;
+    char *p;
+
+    if (*length > lpuart_tx_fifo.size) return NULL;
+
+    while ((p = cbuf_reserve(&lpuart_tx_fifo, length)) == NULL) {
+        blocked = true;
+        masked = disable_irq();
+        if (tx_idle && cbuf_length(&lpuart_tx_fifo) == 0) {
+            // The FIFO is empty and no DMA transfer is reading from it. Rewind
+            // both indices to the beginning of the memory buffer so that all
+            // of the free space becomes contiguous.
+            cbuf_init(&lpuart_tx_fifo, tx_buffer, sizeof(tx_buffer));
+        } else {
+            // Wait for the DMA transfer to finish. See lpuart_write_blocking
+            // for why system_idle cannot enter the Stop mode here.
+            system_idle();
+        }
+        reenable_irq(masked);
+    }
+
+    if (blocked) add_blocked_time(start);
+    return p;
+}
+
+
+void lpuart_commit(size_t length)
+{
+    cbuf_commit(&lpuart_tx_fifo, length);
+    start_tx();
+}
+
+
 void lpuart_write_blocking(const char *buffer, size_t length)
 {
     uint32_t masked;
@@ -309,7 +525,8 @@ void lpuart_write_blocking(const char *buffer, size_t length)
         length -= written;
 
         if (written == 0) {
-            while (lpuart_tx_fifo.max_length == lpuart_tx_fifo.length) {
+            uint32_t start = HAL_GetTick();
+            while (cbuf_space(&lpuart_tx_fifo) == 0) {
                 masked = disable_irq();
                 // If the TX FIFO is at full capacity, we invoke system_idle to
                 // put the MCU to sleep until there is some space in the output
@@ -319,10 +536,11 @@ void lpuart_write_blocking(const char *buffer, size_t length)
                 // guaranteed, since the function luart_write above creates a
                 // stop mode wake lock which will still be in place when the
                 // process gets here.
-                if (lpuart_tx_fifo.max_length == lpuart_tx_fifo.length)
+                if (cbuf_space(&lpuart_tx_fifo) == 0)
                     system_idle();
                 reenable_irq(masked);
             }
+            add_blocked_time(start);
         }
     }
 }
@@ -332,9 +550,12 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef *port)
 {
     cbuf_view_t v;
 
-    if (tx_len) cbuf_consume(&lpuart_tx_fifo, tx_len);
+    if (tx_len) {
+        cbuf_consume(&lpuart_tx_fifo, tx_len);
+        stats.tx_bytes += tx_len;
+    }
 
-    if (lpuart_tx_fifo.length) {
+    if (cbuf_length(&lpuart_tx_fifo)) {
         cbuf_head(&lpuart_tx_fifo, &v);
         if (v.len[0]) {
             HAL_UART_Transmit_DMA(port, (unsigned char *)v.ptr[0], v.len[0]);
@@ -373,21 +594,36 @@ void RNG_LPUART1_IRQHandler(void)
         system_stop_lock &= ~SYSTEM_MODULE_LPUART_RX;
     }
 
-    // Delegate to the HAL. But before we do that, check and clear the error
-    // flags, otherwise the HAL would abort the DMA transfer. These errors are
-    // actually disabled in the init function, but better be safe than sorry.
+    // Delegate to the HAL. But before we do that, check, count, and clear the
+    // error flags, otherwise the HAL would abort the DMA transfer. The error
+    // interrupt is enabled, so each error event is counted separately.
 
-    if (LL_LPUART_IsActiveFlag_PE(port.Instance))
+    if (LL_LPUART_IsActiveFlag_PE(port.Instance)) {
         LL_LPUART_ClearFlag_PE(port.Instance);
+        stats.parity_errors++;
+    }
 
-    if (LL_LPUART_IsActiveFlag_FE(port.Instance))
+    if (LL_LPUART_IsActiveFlag_FE(port.Instance)) {
         LL_LPUART_ClearFlag_FE(port.Instance);
+        stats.framing_errors++;
+    }
 
-    if (LL_LPUART_IsActiveFlag_ORE(port.Instance))
+    if (LL_LPUART_IsActiveFlag_ORE(port.Instance)) {
         LL_LPUART_ClearFlag_ORE(port.Instance);
+        stats.overruns++;
+
+        // With the RX DMA transfer stopped, each overrun is a byte that did
+        // not fit into the full RX FIFO
+        if (rx_span == 0) {
+            stats.rx_dropped++;
+            stats.rx_bytes++;
+        }
+    }
 
-    if (LL_LPUART_IsActiveFlag_NE(port.Instance))
+    if (LL_LPUART_IsActiveFlag_NE(port.Instance)) {
         LL_LPUART_ClearFlag_NE(port.Instance);
+        stats.noise_errors++;
+    }
 
     HAL_UART_IRQHandler(&port);
 }
@@ -400,10 +636,13 @@ void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *port)
 }
 
 
+// The DMA transfer has filled its span of free space. Publish the data and
+// continue with the next span, if there is any free space left.
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *handle)
 {
     (void)handle;
     rx_callback();
+    start_rx();
 }
 
 
@@ -424,30 +663,53 @@ void lpuart_before_stop(void)
 void lpuart_after_stop(void)
 {
     LL_LPUART_DisableIT_WKUP(port.Instance);
-    HAL_UART_DMAResume(&port);
 
-    // Resuming DMA re-enables the LPUART1 error interrupt, so we need to
-    // disable it here again. We ignore all errors on LPUART1 and let upper
-    // layers (ATCI) deal with it.
-    LL_LPUART_DisableIT_ERROR(port.Instance);
+    // HAL_UART_DMAResume clears the ORE flag. Count an overrun that happened
+    // while the DMA request was paused first.
+    if (LL_LPUART_IsActiveFlag_ORE(port.Instance)) stats.overruns++;
+    HAL_UART_DMAResume(&port);
 }
 
 
 size_t lpuart_read(char *buffer, size_t length)
+{
+    // The RX DMA interrupt handlers are the only producer and the main loop is
+    // the only consumer of the RX FIFO, so there is no need to mask interrupts.
+    size_t n = cbuf_get(&lpuart_rx_fifo, buffer, length);
+    update_rts_on();
+    resume_rx();
+    return n;
+}
+
+
+size_t lpuart_consume(size_t length)
+{
+    size_t n = cbuf_consume(&lpuart_rx_fifo, length);
+    update_rts_on();
+    resume_rx();
+    return n;
+}
+
+
+void lpuart_set_flow_control(bool enabled)
 {
     uint32_t masked = disable_irq();
-    cbuf_view_t v;
 
-    cbuf_head(&lpuart_rx_fifo, &v);
-    reenable_irq(masked);
+    // Release the flow control pins before the configuration changes
+    deinit_gpio();
 
-    size_t rv = cbuf_copy_out(buffer, &v, length);
+    flow_control = enabled;
+    rts_asserted = true;
 
-    masked = disable_irq();
-    cbuf_consume(&lpuart_rx_fifo, rv);
-    reenable_irq(masked);
+    // The CTSE bit can only be written while the peripheral is disabled
+    __HAL_UART_DISABLE(&port);
+    if (enabled) LL_LPUART_EnableCTSHWFlowCtrl(LPUART1);
+    else LL_LPUART_DisableCTSHWFlowCtrl(LPUART1);
+    port.Init.HwFlowCtl = enabled ? UART_HWCONTROL_CTS : UART_HWCONTROL_NONE;
+    __HAL_UART_ENABLE(&port);
 
-    return rv;
+    init_gpio();
+    reenable_irq(masked);
 }
 
 
@@ -470,4 +732,20 @@ void HAL_UART_ErrorCallback(UART_HandleTypeDef *port)
 {
     (void)port;
     log_error("LPUART1 error: %ld", port->ErrorCode);
-}
\ No newline at end of file
+}
+
+
+void lpuart_get_stats(lpuart_stats_t *dst)
+{
+    uint32_t masked = disable_irq();
+    memcpy(dst, (const lpuart_stats_t *)&stats, sizeof(*dst));
+    reenable_irq(masked);
+}
+
+
+void lpuart_reset_stats(void)
+{
+    uint32_t masked = disable_irq();
+    memset((lpuart_stats_t *)&stats, 0, sizeof(stats));
+    reenable_irq(masked);
+}
@@ -2,6 +2,8 @@
 #define __LPUART_H__
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include "cbuf.h"
 
 
@@ -9,12 +11,33 @@ extern volatile cbuf_t lpuart_tx_fifo;
 extern volatile cbuf_t lpuart_rx_fifo;
 
 
+/*! @brief LPUART1 link statistics
+ *
+ * The counters are maintained in all builds, including release builds where
+ * logging is compiled out. They can be used to tell whether a baud rate or
+ * burst size is safe for a particular host.
+ */
+typedef struct lpuart_stats {
+    uint32_t rx_bytes;       //! Bytes received, including dropped bytes
+    uint32_t tx_bytes;       //! Bytes transmitted
+    uint32_t rx_dropped;     //! Received bytes lost to a full RX FIFO
+    uint32_t parity_errors;  //! Parity error (PE) events
+    uint32_t framing_errors; //! Framing error (FE) events
+    uint32_t noise_errors;   //! Noise error (NE) events
+    uint32_t overruns;       //! Overrun error (ORE) events
+    uint32_t rx_peak;        //! Maximum number of bytes in the RX FIFO
+    uint32_t tx_peak;        //! Maximum number of bytes in the TX FIFO
+    uint32_t tx_blocked_ms;  //! Time spent waiting for space in a full TX FIFO
+} lpuart_stats_t;
+
+
 
 /*! @brief Initialize LPUART1
  *
  * Initialize the LPUART1 port for buffered DMA-based I/O. Both transmission and
  * reception will use DMA. Two fixed-size FIFOs backed by circular buffers are
- * used to enque outgoing and incoming data.
+ * used to enque outgoing and incoming data. Baud rates up to 9600 are clocked
+ * from LSE, higher baud rates from HSI16.
  *
  * @param[in] baudrate The baudrate to be configured
  */
@@ -52,6 +75,31 @@ size_t lpuart_write(const char *buffer, size_t length);
 void lpuart_write_blocking(const char *buffer, size_t length);
 
 
+/*! @brief Reserve contiguous space for outgoing data in the LPUART1 TX queue
+ *
+ * Return a pointer to at least @p *length bytes of contiguous memory in the
+ * internal transmission queue. The caller can write data into the memory
+ * directly and then schedule it for transmission with lpuart_commit, avoiding
+ * an extra copy. On return, @p *length contains the size of the reserved
+ * space, which may be larger than requested.
+ *
+ * This function blocks until enough contiguous space is available. If the
+ * free space at the end of the queue is too short, the function waits for the
+ * queue to drain and starts over from the beginning of the queue memory.
+ *
+ * @param[inout] length Minimum number of bytes on input, size of the reserved space on output
+ * @return A pointer to the reserved space or NULL if @p *length exceeds the size of the queue
+ */
+char *lpuart_reserve(size_t *length);
+
+
+/*! @brief Schedule data written into memory obtained with lpuart_reserve for transmission
+ *
+ * @param[in] length The number of bytes to be sent (less than or equal to the reserved size)
+ */
+void lpuart_commit(size_t length);
+
+
 /*! @brief Read up to @p length bytes from LPUART1
  *
  * This function reads up to @p length bytes from the LPUART1 port and copies
@@ -68,6 +116,45 @@ void lpuart_write_blocking(const char *buffer, size_t length);
 size_t lpuart_read(char *buffer, size_t length);
 
 
+/*! @brief Remove @p length bytes from the beginning of the LPUART1 RX queue
+ *
+ * This function is meant to be used by applications that parse received data
+ * in place through a view obtained with cbuf_head on lpuart_rx_fifo. Unlike
+ * calling cbuf_consume directly, it lets the host send more data if flow
+ * control is enabled.
+ *
+ * @param[in] length The number of bytes to remove
+ * @return The number of bytes removed
+ */
+size_t lpuart_consume(size_t length);
+
+
+/*! @brief Enable or disable RTS/CTS flow control on LPUART1
+ *
+ * With flow control enabled, the peripheral only transmits while the host
+ * asserts CTS (PB13) and the firmware deasserts RTS (PB14) while the RX queue
+ * is close to full. Both signals are active low. RTS is driven by the
+ * firmware with hysteresis rather than by the peripheral so that the host has
+ * enough time to react before the queue overflows. The Stop mode wake-up on
+ * received data is not affected.
+ *
+ * @param[in] enabled true to enable flow control, false to disable it
+ */
+void lpuart_set_flow_control(bool enabled);
+
+
+/*! @brief Return a snapshot of the LPUART1 link statistics
+ *
+ * @param[out] dst Pointer to the structure to be filled
+ */
+void lpuart_get_stats(lpuart_stats_t *dst);
+
+
+/*! @brief Reset all LPUART1 link statistics to zero
+ */
+void lpuart_reset_stats(void);
+
+
 /*! @brief Wait for all data from internal queue to be sent
  *
  * This function blocks until all data from the internal queue have been
@@ -24,9 +24,73 @@
 
 #define MAX_BAT 254
 
+// The size of the memory used to store received downlinks while the downlink
+// mailbox is enabled (see sysconf.mailbox_depth). The number of stored
+// downlinks is limited by the configured depth and by this size. Each entry
+// takes a 16-byte header plus the payload, so the default size holds a single
+// downlink with the largest LoRaWAN payload (242 B), or, e.g., twelve
+// downlinks with payloads of up to 24 bytes.
+#ifndef LRW_MAILBOX_SIZE
+#define LRW_MAILBOX_SIZE 512
+#endif
+
+// Each mailbox entry is stored at an offset aligned to the entry header
+#define MAILBOX_ENTRY_SIZE(len) ((sizeof(lrw_downlink_t) + (len) + 3) & ~3u)
+
+static_assert(LRW_MAILBOX_SIZE >= MAILBOX_ENTRY_SIZE(255),
+    "LRW_MAILBOX_SIZE is too small for the largest downlink");
+
+// The size of the memory used to store uplinks queued with AT$QTX. Each entry
+// consists of a txq_entry_t header followed by the payload, padded to a
+// multiple of four bytes.
+#ifndef LRW_TXQ_SIZE
+#define LRW_TXQ_SIZE 512
+#endif
+
+typedef struct {
+    TimerTime_t time;   // When the uplink was queued
+    uint32_t handle;
+    uint8_t port;
+    uint8_t confirmed;
+    uint8_t length;
+    uint8_t data[];
+} txq_entry_t;
+
+#define TXQ_ENTRY_SIZE(len) ((sizeof(txq_entry_t) + (len) + 3) & ~3u)
+
+static_assert(LRW_TXQ_SIZE >= TXQ_ENTRY_SIZE(255),
+    "LRW_TXQ_SIZE is too small for the largest uplink");
+
+// The maximum size of a payload sent with fragmentation (see lrw_frag_send).
+// Each fragment carries a FRAG_HEADER_SIZE-byte header: the transfer id, and
+// the offset of the fragment's data within the payload as a little-endian
+// 15-bit number. The most significant bit of the offset marks the last
+// fragment.
+#ifndef LRW_FRAG_SIZE
+#define LRW_FRAG_SIZE 1024
+#endif
+
+#define FRAG_HEADER_SIZE 3
+#define FRAG_LAST 0x8000
+
+static_assert(LRW_FRAG_SIZE <= FRAG_LAST,
+    "LRW_FRAG_SIZE is too large for the fragment offset field");
+
+// How long to wait before checking again whether a queued uplink can be sent
+// if the MAC is busy but did not tell us for how long.
+#ifndef LRW_TXQ_RETRY_INTERVAL
+#define LRW_TXQ_RETRY_INTERVAL 500
+#endif
+
 
 unsigned int lrw_event_subtype;
 static McpsConfirm_t tx_params;
+
+// Each uplink accepted from the host gets a handle that tags all messages
+// about the uplink sent to the host later. Handles increase monotonically and
+// skip 0 on wrap-around. tx_handle is the handle of the uplink in the MAC.
+static uint32_t last_handle;
+static uint32_t tx_handle;
 static int joins_left = 0;
 static TimerEvent_t join_retry_timer;
 static uint8_t join_datarate;
@@ -41,6 +105,55 @@ enum lora_event {
 
 static unsigned events;
 
+static struct {
+    uint32_t data[LRW_TXQ_SIZE / 4];
+    size_t length;
+    unsigned int count;
+    unsigned int pending;   // Number of uplinks passed to the MAC
+} txq;
+
+static TimerEvent_t txq_timer;
+
+// The frame with uplinks packed together by send_queued_uplink, with the
+// next fragment, or with the deferred payload. LoRaMac keeps a reference to
+// the payload until the transmission completes. Queued uplinks and fragments
+// are not sent while there is a deferred payload, so they can share the frame.
+static uint8_t txq_frame[LORAMAC_PHY_MAXPAYLOAD];
+
+// An uplink whose payload did not fit into the frame next to the pending MAC
+// commands. The MAC commands are flushed with an empty uplink first and the
+// payload, kept in txq_frame, is sent once that uplink is complete.
+static struct {
+    uint8_t port;
+    uint8_t length;
+    bool confirmed;
+    enum {
+        DEFERRED_NONE,
+        DEFERRED_FLUSHING,  // The flush uplink has been passed to the MAC
+        DEFERRED_READY,     // The payload waits for the MAC and duty cycle
+        DEFERRED_DROPPED    // The flush uplink is in the MAC, the payload was dropped
+    } state;
+} deferred;
+
+static struct {
+    uint8_t data[LRW_FRAG_SIZE];
+    size_t length;
+    size_t sent;        // Number of bytes acknowledged by mcps_confirm
+    size_t size;        // Number of bytes in the fragment passed to the MAC
+    uint8_t id;
+    uint8_t port;
+    bool confirmed;
+    bool active;        // A transfer is in progress
+    bool pending;       // A fragment has been passed to the MAC
+} frag;
+
+static struct {
+    uint32_t data[LRW_MAILBOX_SIZE / 4];
+    size_t length;
+    unsigned int count;
+    uint32_t dropped;
+} mailbox;
+
 
 static struct {
     const char *name;
@@ -104,12 +217,52 @@ static void process_notify(void)
 }
 
 
+// The NVM notify flag of the LoRaMac state group being written to NVM in the
+// background and the name of the group for log messages
+static uint16_t nvm_writing;
+static const char *nvm_writing_name;
+
+
+static void state_saved(bool success)
+{
+    // Set the flag again so that lrw_process retries the write
+    if (!success) {
+        log_error("Error while writing %s state to NVM, will retry", nvm_writing_name);
+        nvm_flags |= nvm_writing;
+    }
+    nvm_writing = LORAMAC_NVM_NOTIFY_FLAG_NONE;
+}
+
+
+static void save_group(uint16_t flag, part_t *part, const void *data, size_t size, const char *name)
+{
+    log_debug("Saving %s state to NVM", name);
+
+    // The write could not be started, e.g., because the EEPROM is still busy.
+    // Leave the flag set so that the next invocation of lrw_process retries.
+    if (!part_write_async(part, 0, data, size, state_saved)) {
+        log_debug("Could not start writing %s state to NVM, will retry", name);
+        return;
+    }
+
+    // Clear the flag once the write has started. Changes made by LoRaMac while
+    // the write is in progress set the flag again and schedule another write.
+    nvm_flags &= ~flag;
+    nvm_writing = flag;
+    nvm_writing_name = name;
+}
+
+
 static void save_state(void)
 {
     uint32_t mask;
     LoRaMacNvmData_t *s;
 
-    if (nvm_flags == LORAMAC_NVM_NOTIFY_FLAG_NONE) {
+    // Let the main loop sleep while a group is being written. The EEPROM
+    // driver keeps the MCU out of Stop mode and wakes the main loop up once
+    // the write has finished. It uses its own sleep lock bit, so clearing
+    // ours here cannot lose that wakeup.
+    if (nvm_flags == LORAMAC_NVM_NOTIFY_FLAG_NONE || nvm_writing != LORAMAC_NVM_NOTIFY_FLAG_NONE) {
         mask = disable_irq();
         system_sleep_lock &= ~SYSTEM_MODULE_NVM;
         reenable_irq(mask);
@@ -120,112 +273,78 @@ static void save_state(void)
     system_sleep_lock |= SYSTEM_MODULE_NVM;
     reenable_irq(mask);
 
+    if (LoRaMacIsBusy()) return;
+
     s = lrw_get_state();
 
     if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_CRYPTO) {
-        if (LoRaMacIsBusy()) return;
-
-        log_debug("Saving Crypto state to NVM");
-        if (!part_write(&nvm_parts.crypto, 0, &s->Crypto, sizeof(s->Crypto)))
-            log_error("Error while writing Crypto state to NVM");
-        nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_CRYPTO;
-        return;
-    }
-
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1) {
-        if (LoRaMacIsBusy()) return;
-
-        log_debug("Saving MacGroup1 state to NVM");
-        if (!part_write(&nvm_parts.mac1, 0, &s->MacGroup1, sizeof(s->MacGroup1)))
-            log_error("Error while writing MacGroup1 state to NVM");
-        nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1;
-        return;
-    }
-
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2) {
-        if (LoRaMacIsBusy()) return;
-
-        log_debug("Saving MacGroup2 state to NVM");
-        if (!part_write(&nvm_parts.mac2, 0, &s->MacGroup2, sizeof(s->MacGroup2)))
-            log_error("Error while writing MacGroup2 state to NVM");
-        nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2;
-        return;
-    }
-
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT) {
-        if (LoRaMacIsBusy()) return;
-
-        log_debug("Saving SecureElement state to NVM");
-        if (!part_write(&nvm_parts.se, 0, &s->SecureElement, sizeof(s->SecureElement)))
-            log_error("Error while writing SecureElement state to NVM");
-        nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT;
-        return;
-    }
-
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1) {
-        if (LoRaMacIsBusy()) return;
-
-        log_debug("Saving RegionGroup1 state to NVM");
-        if (!part_write(&nvm_parts.region1, 0, &s->RegionGroup1, sizeof(s->RegionGroup1)))
-            log_error("Error while writing RegionGroup1 state to NVM");
-        nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1;
-        return;
+        // In the common case, only the uplink frame counter has changed. Append
+        // it to the journal rather than rewriting the crypto group in place. If
+        // neither write can be started, the flag stays set and both are retried.
+        if (nvm_journal_append(&s->Crypto, state_saved)) {
+            nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_CRYPTO;
+            nvm_writing = LORAMAC_NVM_NOTIFY_FLAG_CRYPTO;
+            nvm_writing_name = "FCnt journal";
+            return;
+        }
+        save_group(LORAMAC_NVM_NOTIFY_FLAG_CRYPTO, &nvm_parts.crypto,
+            &s->Crypto, sizeof(s->Crypto), "Crypto");
+    } else if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1) {
+        save_group(LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP1, &nvm_parts.mac1,
+            &s->MacGroup1, sizeof(s->MacGroup1), "MacGroup1");
+    } else if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2) {
+        save_group(LORAMAC_NVM_NOTIFY_FLAG_MAC_GROUP2, &nvm_parts.mac2,
+            &s->MacGroup2, sizeof(s->MacGroup2), "MacGroup2");
+    } else if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT) {
+        save_group(LORAMAC_NVM_NOTIFY_FLAG_SECURE_ELEMENT, &nvm_parts.se,
+            &s->SecureElement, sizeof(s->SecureElement), "SecureElement");
+    } else if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1) {
+        save_group(LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP1, &nvm_parts.region1,
+            &s->RegionGroup1, sizeof(s->RegionGroup1), "RegionGroup1");
+    } else if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2) {
+        save_group(LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2, &nvm_parts.region2,
+            &s->RegionGroup2, sizeof(s->RegionGroup2), "RegionGroup2");
+    } else if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_CLASS_B) {
+        save_group(LORAMAC_NVM_NOTIFY_FLAG_CLASS_B, &nvm_parts.classb,
+            &s->ClassB, sizeof(s->ClassB), "ClassB");
     }
+}
 
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2) {
-        if (LoRaMacIsBusy()) return;
 
-        log_debug("Saving RegionGroup2 state to NVM");
-        if (!part_write(&nvm_parts.region2, 0, &s->RegionGroup2, sizeof(s->RegionGroup2)))
-            log_error("Error while writing RegionGroup2 state to NVM");
-        nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_REGION_GROUP2;
-        return;
-    }
-
-    if (nvm_flags & LORAMAC_NVM_NOTIFY_FLAG_CLASS_B) {
-        if (LoRaMacIsBusy()) return;
+// Copy a LoRaMac state group from NVM into the MAC's state if its checksum
+// is valid. Otherwise the MAC keeps the defaults for the group.
+static bool restore_group(void *group, part_t *part, size_t size)
+{
+    size_t n;
+    const unsigned char *p = part_mmap(&n, part);
 
-        log_debug("Saving ClassB state to NVM");
-        if (!part_write(&nvm_parts.classb, 0, &s->ClassB, sizeof(s->ClassB)))
-            log_error("Error while writing ClassB state to NVM");
-        nvm_flags &= ~LORAMAC_NVM_NOTIFY_FLAG_CLASS_B;
-        return;
-    }
+    if (p == NULL || n < size || !check_block_crc(p, size)) return false;
+    memcpy(group, p, size);
+    return true;
 }
 
 
+// Restore the LoRaMac state directly into the MAC's own context rather than a
+// temporary copy, which would need several kilobytes of stack. LoRaMac only
+// takes over groups with a valid checksum, which restore_group guarantees.
 static void restore_state(void)
 {
-    size_t size;
-    const unsigned char *p;
-    LoRaMacNvmData_t s;
-
-    memset(&s, 0, sizeof(s));
-
-    p = part_mmap(&size, &nvm_parts.crypto);
-    if (p && size >= sizeof(s.Crypto)) memcpy(&s.Crypto, p, sizeof(s.Crypto));
-
-    p = part_mmap(&size, &nvm_parts.mac1);
-    if (p && size >= sizeof(s.MacGroup1)) memcpy(&s.MacGroup1, p, sizeof(s.MacGroup1));
-
-    p = part_mmap(&size, &nvm_parts.mac2);
-    if (p && size >= sizeof(s.MacGroup2)) memcpy(&s.MacGroup2, p, sizeof(s.MacGroup2));
-
-    p = part_mmap(&size, &nvm_parts.se);
-    if (p && size >= sizeof(s.SecureElement)) memcpy(&s.SecureElement, p, sizeof(s.SecureElement));
-
-    p = part_mmap(&size, &nvm_parts.region1);
-    if (p && size >= sizeof(s.RegionGroup1)) memcpy(&s.RegionGroup1, p, sizeof(s.RegionGroup1));
+    LoRaMacNvmData_t *s = lrw_get_state();
 
-    p = part_mmap(&size, &nvm_parts.region2);
-    if (p && size >= sizeof(s.RegionGroup2)) memcpy(&s.RegionGroup2, p, sizeof(s.RegionGroup2));
+    if (restore_group(&s->Crypto, &nvm_parts.crypto, sizeof(s->Crypto)) &&
+        nvm_journal_replay(&s->Crypto))
+        update_block_crc(&s->Crypto, sizeof(s->Crypto));
 
-    p = part_mmap(&size, &nvm_parts.classb);
-    if (p && size >= sizeof(s.ClassB)) memcpy(&s.ClassB, p, sizeof(s.ClassB));
+    restore_group(&s->MacGroup1, &nvm_parts.mac1, sizeof(s->MacGroup1));
+    restore_group(&s->MacGroup2, &nvm_parts.mac2, sizeof(s->MacGroup2));
+    restore_group(&s->SecureElement, &nvm_parts.se, sizeof(s->SecureElement));
+    restore_group(&s->RegionGroup1, &nvm_parts.region1, sizeof(s->RegionGroup1));
+    restore_group(&s->RegionGroup2, &nvm_parts.region2, sizeof(s->RegionGroup2));
+    restore_group(&s->ClassB, &nvm_parts.classb, sizeof(s->ClassB));
 
     MibRequestConfirm_t r = {
         .Type = MIB_NVM_CTXS,
-        .Param = { .Contexts = &s }
+        .Param = { .Contexts = s }
     };
     int rc = LoRaMacMibSetRequestConfirm(&r);
     if (rc != LORAMAC_STATUS_OK)
@@ -309,24 +428,151 @@ static void state_changed(uint16_t flags)
 
 static void on_ack(bool ack_received)
 {
-    if (ack_received) {
+    atci_urc_begin(ATCI_URC_HIGH);
+    if (sysconf.uplink_handles) {
+        atci_printf("+%s=%lu\r\n\r\n", ack_received ? "ACK" : "NOACK", tx_handle);
+    } else if (ack_received) {
         cmd_print("+ACK\r\n\r\n");
     } else {
         cmd_print("+NOACK\r\n\r\n");
     }
+    atci_urc_end();
+}
+
+
+static void mailbox_drop(void)
+{
+    size_t size = MAILBOX_ENTRY_SIZE(((lrw_downlink_t *)mailbox.data)->length);
+
+    mailbox.length -= size;
+    mailbox.count--;
+    memmove(mailbox.data, (uint8_t *)mailbox.data + size, mailbox.length);
+}
+
+
+// Store a received downlink in the mailbox. If the mailbox is full, the oldest
+// downlinks are dropped to make room for the new one.
+static void mailbox_store(McpsIndication_t *param)
+{
+    size_t size = MAILBOX_ENTRY_SIZE(param->BufferSize);
+    lrw_downlink_t *d;
+
+    while (mailbox.count != 0 &&
+        (mailbox.count >= sysconf.mailbox_depth || sizeof(mailbox.data) - mailbox.length < size)) {
+        mailbox_drop();
+        mailbox.dropped++;
+    }
+
+    d = (lrw_downlink_t *)((uint8_t *)mailbox.data + mailbox.length);
+    d->time = rtc_tick2ms(rtc_get_timer_value());
+    d->fcnt = param->DownLinkCounter;
+    d->rssi = param->Rssi;
+    d->snr = param->Snr;
+    d->port = param->Port;
+    d->length = param->BufferSize;
+    memcpy(d->data, param->Buffer, param->BufferSize);
+
+    mailbox.length += size;
+    mailbox.count++;
 }
 
 
 static void recv(uint8_t port, uint8_t *buffer, uint8_t length)
 {
+    atci_urc_begin(ATCI_URC_HIGH);
     atci_printf("+RECV=%d,%d\r\n\r\n", port, length);
 
-    if (sysconf.data_format) {
+    // The framed mode is binary-safe, send the payload as is
+    if (sysconf.data_format && !atci_framing_enabled()) {
         atci_print_buffer_as_hex(buffer, length);
     } else {
         atci_write((char *) buffer, length);
     }
     atci_write("\r\n", 2);
+    atci_urc_end();
+}
+
+
+static uint32_t next_handle(void)
+{
+    if (++last_handle == 0) last_handle = 1;
+    return last_handle;
+}
+
+
+static txq_entry_t *txq_entry(size_t offset)
+{
+    return (txq_entry_t *)((uint8_t *)txq.data + offset);
+}
+
+
+// Remove the first n uplinks from the queue and notify the host of the result
+static void finish_queued_uplinks(unsigned int n, int status, uint32_t fcnt, bool acked)
+{
+    size_t size = 0;
+    txq_entry_t *e;
+
+    for (; n > 0; n--) {
+        e = txq_entry(size);
+        cmd_qtx(e->handle, status, fcnt, acked);
+        size += TXQ_ENTRY_SIZE(e->length);
+        txq.count--;
+    }
+
+    txq.pending = 0;
+    txq.length -= size;
+    memmove(txq.data, (uint8_t *)txq.data + size, txq.length);
+}
+
+
+// End the current fragmented transfer and discard its payload
+static void finish_fragments(void)
+{
+    frag.active = false;
+    frag.length = 0;
+    frag.sent = 0;
+}
+
+
+static void confirm_fragment(bool acked)
+{
+    frag.pending = false;
+
+    // The transfer may have been cancelled while the fragment was in flight
+    if (!frag.active) return;
+
+    if (!acked) {
+        cmd_ftx(frag.id, LORAMAC_STATUS_OK, frag.sent, frag.length, false);
+        finish_fragments();
+        return;
+    }
+
+    frag.sent += frag.size;
+    cmd_ftx(frag.id, LORAMAC_STATUS_OK, frag.sent, frag.length, true);
+    if (frag.sent == frag.length) finish_fragments();
+}
+
+
+// Report the metadata of a completed uplink to the host with +TXDONE=<handle>,
+// <fcnt>,<datarate>,<channel>,<frequency>,<tx power>,<time on air>,
+// <transmissions>,<status>. The TX power is the regional TX power index, the time on air is in
+// milliseconds, and the status is a LoRaMacEventInfoStatus_t value.
+static void on_tx_done(McpsConfirm_t *param)
+{
+    uint32_t freq = 0;
+
+    GetPhyParams_t pr = { .Attribute = PHY_MAX_NB_CHANNELS };
+    unsigned nb_channels = RegionGetPhyParam(lrw_get_state()->MacGroup2.Region, &pr).Value;
+
+    MibRequestConfirm_t r = { .Type = MIB_CHANNELS };
+    if (LoRaMacMibGetRequestConfirm(&r) == LORAMAC_STATUS_OK && param->Channel < nb_channels)
+        freq = r.Param.ChannelList[param->Channel].Frequency;
+
+    atci_urc_begin(ATCI_URC_HIGH);
+    atci_printf("+TXDONE=%lu,%lu,%d,%lu,%lu,%d,%lu,%d,%d\r\n\r\n",
+        tx_handle, param->UpLinkCounter, param->Datarate, param->Channel, freq,
+        param->TxPower, param->TxTimeOnAir, param->NbTrans, param->Status);
+    atci_urc_end();
 }
 
 
@@ -335,14 +581,46 @@ static void mcps_confirm(McpsConfirm_t *param)
     log_debug("mcps_confirm: McpsRequest: %d, Channel: %ld AckReceived: %d", param->McpsRequest, param->Channel, param->AckReceived);
     tx_params = *param;
 
-    if (param->McpsRequest == MCPS_CONFIRMED)
+    // The sender of the deferred payload expects a single confirmation for the
+    // payload, not for the uplink that flushed the MAC commands
+    if (deferred.state == DEFERRED_FLUSHING) {
+        deferred.state = DEFERRED_READY;
+        return;
+    }
+
+    if (deferred.state == DEFERRED_DROPPED) {
+        deferred.state = DEFERRED_NONE;
+        return;
+    }
+
+    if (sysconf.txdone_urc)
+        on_tx_done(param);
+
+    // Queued uplinks and fragments report the outcome with +QTX and +FTX.
+    // Only confirmed uplinks sent with AT+CTX or AT+PCTX get +ACK or +NOACK.
+    if (param->McpsRequest == MCPS_CONFIRMED && !txq.pending && !frag.pending)
         on_ack(param->AckReceived == 1);
+
+    if (txq.pending)
+        finish_queued_uplinks(txq.pending, LORAMAC_STATUS_OK, param->UpLinkCounter,
+            param->McpsRequest != MCPS_CONFIRMED || param->AckReceived);
+
+    if (frag.pending)
+        confirm_fragment(param->McpsRequest != MCPS_CONFIRMED || param->AckReceived);
 }
 
 
 static void mcps_retransmit(void)
 {
-    cmd_event(CMD_EVENT_NETWORK, CMD_NET_RETRANSMISSION);
+    if (!sysconf.uplink_handles) {
+        cmd_event(CMD_EVENT_NETWORK, CMD_NET_RETRANSMISSION);
+        return;
+    }
+
+    // Tell the host which uplink is being retransmitted
+    atci_urc_begin(ATCI_URC_LOW);
+    atci_printf("+EVENT=%d,%d,%lu" ATCI_EOL, CMD_EVENT_NETWORK, CMD_NET_RETRANSMISSION, tx_handle);
+    atci_urc_end();
 }
 
 
@@ -355,7 +633,13 @@ static void mcps_indication(McpsIndication_t *param)
     }
 
     if (param->RxData) {
-        recv(param->Port, param->Buffer, param->BufferSize);
+        // With the mailbox enabled, the host polls for downlinks with AT$RECV
+        // instead of receiving them unsolicited.
+        if (sysconf.mailbox_depth) {
+            mailbox_store(param);
+        } else {
+            recv(param->Port, param->Buffer, param->BufferSize);
+        }
     }
 
     if (param->IsUplinkTxPending == true) {
@@ -487,6 +771,15 @@ static void retransmit_join(void)
 }
 
 
+static void on_txq_timer(void *ctx)
+{
+    // Invoked in the ISR context. Prevent sleep so that lrw_process gets to
+    // send the next queued uplink.
+    (void)ctx;
+    system_sleep_lock |= SYSTEM_MODULE_LORA;
+}
+
+
 static void on_join_timer(void *ctx)
 {
     // This handler is invoked in the ISR context within an interrupt generated
@@ -704,6 +997,7 @@ void lrw_init(void)
 
     memset(&tx_params, 0, sizeof(tx_params));
     TimerInit(&join_retry_timer, on_join_timer);
+    TimerInit(&txq_timer, on_txq_timer);
 
     LoRaMacRegion_t region = restore_region();
 
@@ -778,7 +1072,7 @@ void lrw_init(void)
 }
 
 
-int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed)
+static LoRaMacStatus_t send_uplink(uint8_t port, void *buffer, uint8_t length, bool confirmed)
 {
     McpsReq_t mr;
     LoRaMacTxInfo_t txi;
@@ -837,8 +1131,34 @@ int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed)
             mr.Req.Unconfirmed.fBufferSize = 0;
             mr.Req.Unconfirmed.Datarate = r.Param.ChannelsDatarate;
 
-            // Intentionally ignore any errors generated by the flush command
-            lrw_mcps_request(&mr);
+            rv = lrw_mcps_request(&mr);
+            if (rv == LORAMAC_STATUS_OK) {
+                // If the payload fits into a frame without the MAC commands,
+                // keep it and send it once the flush uplink is complete. The
+                // caller then gets the confirmation for its payload as usual.
+                // This includes the deferred payload itself if new MAC
+                // commands got in its way again.
+                if (length <= txi.CurrentPossiblePayloadSize && (port == 0 || length != 0)) {
+                    if (buffer != txq_frame) memcpy(txq_frame, buffer, length);
+                    deferred.port = port;
+                    deferred.length = length;
+                    deferred.confirmed = confirmed;
+                    deferred.state = DEFERRED_FLUSHING;
+                    return LORAMAC_STATUS_OK;
+                }
+
+                // Otherwise the payload is dropped. The caller knows nothing
+                // about the flush uplink, so its confirmation is not reported.
+                deferred.state = DEFERRED_DROPPED;
+            } else if (rv == LORAMAC_STATUS_BUSY || rv == LORAMAC_STATUS_DUTYCYCLE_RESTRICTED) {
+                // The flush uplink cannot be sent yet. Report that instead of
+                // the length error so that callers which retry, e.g., the
+                // uplink queue, try again later rather than drop the payload.
+                return rv;
+            }
+
+            // Intentionally ignore any other errors generated by the flush
+            // command
         }
 
         // Return the original status to the caller to indicate that we haven't
@@ -887,6 +1207,267 @@ int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed)
 }
 
 
+// Pass an uplink to the MAC. The caller sets tx_handle on success.
+static LoRaMacStatus_t submit_uplink(uint8_t port, void *buffer, uint8_t length, bool confirmed)
+{
+    // Keep the order of uplinks. The deferred payload goes first.
+    if (deferred.state != DEFERRED_NONE)
+        return LORAMAC_STATUS_BUSY;
+
+    return send_uplink(port, buffer, length, confirmed);
+}
+
+
+int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed)
+{
+    LoRaMacStatus_t rc;
+
+    rc = submit_uplink(port, buffer, length, confirmed);
+    if (rc == LORAMAC_STATUS_OK) tx_handle = next_handle();
+    return rc;
+}
+
+
+uint32_t lrw_uplink_handle(void)
+{
+    return tx_handle;
+}
+
+
+// Report the failure of the deferred payload to whoever sent it
+static void fail_deferred_uplink(LoRaMacStatus_t rc)
+{
+    log_warning("Could not send deferred uplink: %d", rc);
+
+    if (txq.pending) {
+        finish_queued_uplinks(txq.pending, rc, 0, false);
+    } else if (frag.pending) {
+        frag.pending = false;
+        if (frag.active) {
+            cmd_ftx(frag.id, rc, frag.sent, frag.length, false);
+            finish_fragments();
+        }
+    } else if (deferred.confirmed) {
+        // The host waits for +ACK or +NOACK after AT+CTX
+        on_ack(false);
+    }
+}
+
+
+// Send the payload kept by send_uplink once the MAC commands have been flushed
+// and the duty cycle permits. Takes precedence over queued uplinks.
+static void send_deferred_uplink(void)
+{
+    TimerTime_t now, delay = LRW_TXQ_RETRY_INTERVAL;
+    LoRaMacStatus_t rc;
+
+    if (deferred.state != DEFERRED_READY) return;
+
+    if (!LoRaMacIsBusy()) {
+        now = rtc_tick2ms(rtc_get_timer_value());
+        if (lrw_dutycycle_deadline > now) {
+            delay = lrw_dutycycle_deadline - now;
+        } else {
+            rc = send_uplink(deferred.port, txq_frame, deferred.length, deferred.confirmed);
+            if (rc != LORAMAC_STATUS_BUSY && rc != LORAMAC_STATUS_DUTYCYCLE_RESTRICTED) {
+                // If new MAC commands did not leave room for the payload,
+                // send_uplink has flushed them again and either re-armed the
+                // deferral or dropped the payload. Otherwise we are done.
+                if (deferred.state == DEFERRED_READY) deferred.state = DEFERRED_NONE;
+                if (rc != LORAMAC_STATUS_OK) fail_deferred_uplink(rc);
+                return;
+            }
+
+            now = rtc_tick2ms(rtc_get_timer_value());
+            if (lrw_dutycycle_deadline > now)
+                delay = lrw_dutycycle_deadline - now;
+        }
+    }
+
+    TimerStop(&txq_timer);
+    TimerSetValue(&txq_timer, delay);
+    TimerStart(&txq_timer);
+}
+
+
+// Determine how many uplinks from the head of the queue fit into a frame with
+// at most max bytes of payload if sent with aggregation. Sets *wait to true if
+// more uplinks could still be added to the frame, i.e., if the frame is not
+// full and it includes the last uplink in the queue.
+static unsigned int aggregate_uplinks(size_t max, bool *wait)
+{
+    txq_entry_t *head = txq_entry(0), *e;
+    size_t offset = 0, size = 0;
+    unsigned int n = 0;
+
+    *wait = false;
+
+    while (offset < txq.length) {
+        e = txq_entry(offset);
+        if (e->port != head->port || e->confirmed != head->confirmed) return n;
+        if (size + 1 + e->length > max) return n;
+
+        size += 1 + e->length;
+        offset += TXQ_ENTRY_SIZE(e->length);
+        n++;
+    }
+
+    *wait = true;
+    return n;
+}
+
+
+// Copy the first n uplinks into txq_frame, each prefixed with its length.
+// Returns the size of the frame.
+static size_t pack_uplinks(unsigned int n)
+{
+    size_t offset = 0, size = 0;
+    txq_entry_t *e;
+
+    while (n--) {
+        e = txq_entry(offset);
+        txq_frame[size++] = e->length;
+        memcpy(txq_frame + size, e->data, e->length);
+        size += e->length;
+        offset += TXQ_ENTRY_SIZE(e->length);
+    }
+    return size;
+}
+
+
+// Pass the next fragment of the current transfer to the MAC. The fragment is
+// sized to the maximum payload permitted by the current data rate.
+static LoRaMacStatus_t send_fragment(void)
+{
+    LoRaMacTxInfo_t txi;
+    size_t n = frag.length - frag.sent;
+    uint16_t offset = frag.sent;
+
+    LoRaMacQueryTxPossible(0, &txi);
+
+    // If the MAC commands leave no room for any data, size the fragment for a
+    // frame without them. lrw_send then flushes the MAC commands with an empty
+    // frame first and sends the fragment afterwards.
+    size_t max = txi.MaxPossibleApplicationDataSize;
+    if (max <= FRAG_HEADER_SIZE) max = txi.CurrentPossiblePayloadSize;
+    if (max <= FRAG_HEADER_SIZE) max = FRAG_HEADER_SIZE + 1;
+
+    if (n > max - FRAG_HEADER_SIZE) n = max - FRAG_HEADER_SIZE;
+
+    if (frag.sent + n == frag.length) offset |= FRAG_LAST;
+
+    txq_frame[0] = frag.id;
+    txq_frame[1] = offset & 0xff;
+    txq_frame[2] = offset >> 8;
+    memcpy(txq_frame + FRAG_HEADER_SIZE, frag.data + frag.sent, n);
+
+    frag.size = n;
+    return lrw_send(frag.port, txq_frame, FRAG_HEADER_SIZE + n, frag.confirmed);
+}
+
+
+// Pass the first queued uplink to the MAC once the MAC is idle and the duty
+// cycle permits a transmission. If that is not the case yet, check again when
+// the duty cycle quiet period ends. Queued uplinks take precedence over the
+// fragments of a fragmented transfer.
+//
+// With aggregation enabled (see sysconf.aggregation_window), consecutive
+// uplinks for the same port are packed into one frame, each prefixed with its
+// length, up to the maximum payload size permitted by the current data rate.
+// The first uplink in the frame waits for up to aggregation_window
+// milliseconds for more uplinks to arrive.
+static void send_queued_uplink(void)
+{
+    TimerTime_t now, delay = LRW_TXQ_RETRY_INTERVAL;
+    txq_entry_t *head = txq_entry(0);
+    LoRaMacTxInfo_t txi;
+    LoRaMacStatus_t rc;
+    unsigned int n = 1;
+    bool wait, fragment;
+
+    if (txq.pending || frag.pending || deferred.state != DEFERRED_NONE) return;
+    if (txq.count == 0 && !frag.active) return;
+
+    fragment = txq.count == 0;
+
+    if (joins_left == 0 && !LoRaMacIsBusy()) {
+        now = rtc_tick2ms(rtc_get_timer_value());
+        if (lrw_dutycycle_deadline > now) {
+            delay = lrw_dutycycle_deadline - now;
+            goto retry;
+        }
+
+        if (fragment) {
+            rc = send_fragment();
+        } else if (sysconf.aggregation_window) {
+            LoRaMacQueryTxPossible(0, &txi);
+            n = aggregate_uplinks(txi.MaxPossibleApplicationDataSize, &wait);
+
+            if (wait && now - head->time < sysconf.aggregation_window) {
+                delay = sysconf.aggregation_window - (now - head->time);
+                goto retry;
+            }
+
+            // If not even the first uplink fits, send it on its own and let
+            // lrw_send flush the MAC commands first or report the error. Keep
+            // the length prefix so that the payload format on the port remains
+            // the same.
+            if (n == 0) n = 1;
+
+            if (head->length < UINT8_MAX)
+                rc = submit_uplink(head->port, txq_frame, pack_uplinks(n), head->confirmed);
+            else
+                rc = LORAMAC_STATUS_LENGTH_ERROR;
+        } else {
+            rc = submit_uplink(head->port, head->data, head->length, head->confirmed);
+        }
+
+        // The MAC commands that left no room for the fragment could not be
+        // flushed yet. Retry later rather than failing the whole transfer.
+        if (fragment && rc == LORAMAC_STATUS_LENGTH_ERROR)
+            rc = LORAMAC_STATUS_BUSY;
+
+        switch (rc) {
+            case LORAMAC_STATUS_OK:
+                if (fragment) {
+                    frag.pending = true;
+                } else {
+                    txq.pending = n;
+                    tx_handle = head->handle;
+                }
+                return;
+
+            case LORAMAC_STATUS_BUSY:
+            case LORAMAC_STATUS_DUTYCYCLE_RESTRICTED:
+                now = rtc_tick2ms(rtc_get_timer_value());
+                if (lrw_dutycycle_deadline > now)
+                    delay = lrw_dutycycle_deadline - now;
+                break;
+
+            default:
+                // The uplinks cannot be sent at all, e.g., because the payload
+                // is too long for the current data rate.
+                if (fragment) {
+                    cmd_ftx(frag.id, rc, frag.sent, frag.length, false);
+                    finish_fragments();
+                } else {
+                    finish_queued_uplinks(n, rc, 0, false);
+                }
+
+                uint32_t mask = disable_irq();
+                system_sleep_lock |= SYSTEM_MODULE_LORA;
+                reenable_irq(mask);
+                return;
+        }
+    }
+
+retry:
+    TimerStop(&txq_timer);
+    TimerSetValue(&txq_timer, delay);
+    TimerStart(&txq_timer);
+}
+
+
 void lrw_process(void)
 {
     uint32_t mask = disable_irq();
@@ -900,6 +1481,8 @@ void lrw_process(void)
 
     if (Radio.IrqProcess != NULL) Radio.IrqProcess();
     LoRaMacProcess();
+    send_deferred_uplink();
+    send_queued_uplink();
     save_state();
 }
 
@@ -1286,3 +1869,105 @@ void lrw_factory_reset(bool reset_devnonce, bool reset_deveui)
     schedule_reset = true;
 }
 
+
+unsigned int lrw_mailbox_count(void)
+{
+    return mailbox.count;
+}
+
+
+uint32_t lrw_mailbox_dropped(void)
+{
+    return mailbox.dropped;
+}
+
+
+const lrw_downlink_t *lrw_mailbox_peek(void)
+{
+    return mailbox.count ? (const lrw_downlink_t *)mailbox.data : NULL;
+}
+
+
+int lrw_mailbox_drop(void)
+{
+    if (mailbox.count == 0) return -1;
+    mailbox_drop();
+    return 0;
+}
+
+
+int lrw_queue_uplink(uint8_t port, const void *buffer, uint8_t length, bool confirmed, uint32_t *handle)
+{
+    txq_entry_t *e;
+
+    if (sizeof(txq.data) - txq.length < TXQ_ENTRY_SIZE(length)) return -1;
+
+    e = txq_entry(txq.length);
+    e->time = rtc_tick2ms(rtc_get_timer_value());
+    e->handle = *handle = next_handle();
+    e->port = port;
+    e->confirmed = confirmed;
+    e->length = length;
+    memcpy(e->data, buffer, length);
+
+    txq.length += TXQ_ENTRY_SIZE(length);
+    txq.count++;
+
+    uint32_t mask = disable_irq();
+    system_sleep_lock |= SYSTEM_MODULE_LORA;
+    reenable_irq(mask);
+
+    return 0;
+}
+
+
+unsigned int lrw_queued_uplinks(void)
+{
+    return txq.count;
+}
+
+
+int lrw_frag_append(const void *buffer, size_t length)
+{
+    if (frag.active || sizeof(frag.data) - frag.length < length) return -1;
+
+    memcpy(frag.data + frag.length, buffer, length);
+    frag.length += length;
+    return frag.length;
+}
+
+
+int lrw_frag_send(uint8_t port, bool confirmed)
+{
+    // Wait for the last fragment of a cancelled transfer to complete, so that
+    // its confirmation is not attributed to the new transfer
+    if (frag.active || frag.pending || frag.length == 0) return -1;
+
+    // Ids start at 1 and wrap around, skipping 0
+    if (++frag.id == 0) frag.id = 1;
+
+    frag.port = port;
+    frag.confirmed = confirmed;
+    frag.sent = 0;
+    frag.active = true;
+
+    uint32_t mask = disable_irq();
+    system_sleep_lock |= SYSTEM_MODULE_LORA;
+    reenable_irq(mask);
+
+    return frag.id;
+}
+
+
+void lrw_frag_cancel(void)
+{
+    finish_fragments();
+}
+
+
+void lrw_frag_status(unsigned int *id, size_t *sent, size_t *length)
+{
+    *id = frag.active ? frag.id : 0;
+    *sent = frag.sent;
+    *length = frag.length;
+}
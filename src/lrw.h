@@ -7,6 +7,19 @@
 #include "part.h"
 
 
+/** @brief A downlink stored in the downlink mailbox
+ */
+typedef struct lrw_downlink {
+    TimerTime_t time;   //! Time of reception in milliseconds (RTC timer)
+    uint32_t fcnt;      //! Downlink frame counter
+    int16_t rssi;       //! RSSI in dBm
+    int8_t snr;         //! SNR in dB
+    uint8_t port;       //! LoRaWAN port number
+    uint8_t length;     //! Payload length in bytes
+    uint8_t data[];     //! Payload
+} lrw_downlink_t;
+
+
 extern unsigned int lrw_event_subtype;
 extern TimerTime_t lrw_dutycycle_deadline;
 
@@ -43,6 +56,13 @@ void lrw_process(void);
  * to true to request an ACK from the network. Note that the maximum size of the
  * message can vary considerably and depends on the currently selected data rate.
  *
+ * If the message does not fit into the frame because of pending MAC commands,
+ * the MAC commands are sent first in an empty uplink to port 0. The message is
+ * kept and sent automatically once that uplink is complete and the duty cycle
+ * permits. The function returns success in that case and the caller receives
+ * only the confirmation of its own message. Until then, further calls return
+ * LORAMAC_STATUS_BUSY.
+ *
  * @param[in] port LoRaWAN port number
  * @param[in] buffer Pointer to source buffer
  * @param[in] length Number of bytes in the source buffer
@@ -52,6 +72,19 @@ void lrw_process(void);
 int lrw_send(uint8_t port, void *buffer, uint8_t length, bool confirmed);
 
 
+/** @brief Return the handle of the uplink most recently passed to the MAC
+ *
+ * Each uplink accepted by lrw_send or lrw_queue_uplink gets a handle from a
+ * monotonically increasing 32-bit sequence (skipping 0). Messages sent to the
+ * host about the uplink, i.e., +ACK, +NOACK, +EVENT=2,2 (retransmission),
+ * +TXDONE, and +QTX, carry the handle if sysconf.uplink_handles is set
+ * (+TXDONE and +QTX always do).
+ * Multiple uplinks aggregated into one frame are tagged with the handle of the
+ * first one in the frame.
+ */
+uint32_t lrw_uplink_handle(void);
+
+
 /** @brief Activate the node according to the mode selected with AT+MODE
  *
  * This activates the node on the network according to the mode previously
@@ -168,4 +201,90 @@ LoRaMacStatus_t lrw_mcps_request(McpsReq_t* req);
 
 void lrw_factory_reset(bool reset_devnonce, bool reset_deveui);
 
+
+/** @brief Queue an uplink message for transmission
+ *
+ * Queued uplinks are sent one after another as soon as the MAC is idle and the
+ * regional duty cycle permits. The outcome of each uplink is reported to the
+ * host with cmd_qtx. If sysconf.aggregation_window is non-zero, consecutive
+ * uplinks to the same port are sent together in one frame and all of them are
+ * reported with the same frame counter. The arguments are the same as for
+ * lrw_send.
+ *
+ * @param[out] handle The handle of the queued uplink, see lrw_uplink_handle
+ * @return Zero on success or -1 if the queue is full
+ */
+int lrw_queue_uplink(uint8_t port, const void *buffer, uint8_t length, bool confirmed, uint32_t *handle);
+
+
+/** @brief Return the number of queued uplinks, including the one being sent
+ */
+unsigned int lrw_queued_uplinks(void);
+
+
+/** @brief Append data to the payload of the next fragmented transfer
+ *
+ * @return The total size of the payload or -1 if a transfer is in progress or
+ *         the payload would exceed LRW_FRAG_SIZE
+ */
+int lrw_frag_append(const void *buffer, size_t length);
+
+
+/** @brief Start sending the payload collected with lrw_frag_append
+ *
+ * The payload is split into fragments sized to the maximum payload permitted
+ * by the data rate at the time each fragment is sent. Each fragment starts with
+ * a three-byte header: the transfer id and the little-endian offset of the
+ * fragment's data within the payload, with the most significant bit set in the
+ * last fragment. Fragments are sent from lrw_process like queued uplinks, but
+ * only while the uplink queue is empty. The progress is reported to the host
+ * with cmd_ftx after each fragment. The payload is discarded once the transfer
+ * has finished or failed.
+ *
+ * @return The id of the transfer (1-255) or -1 if there is no payload or a
+ *         transfer is in progress
+ */
+int lrw_frag_send(uint8_t port, bool confirmed);
+
+
+/** @brief Cancel the fragmented transfer in progress and discard the payload
+ */
+void lrw_frag_cancel(void);
+
+
+/** @brief Return the state of the fragmented transfer
+ *
+ * @param[out] id The id of the transfer in progress or 0 if there is none
+ * @param[out] sent The number of payload bytes sent so far
+ * @param[out] length The size of the payload
+ */
+void lrw_frag_status(unsigned int *id, size_t *sent, size_t *length);
+
+
+/** @brief Return the number of downlinks stored in the downlink mailbox
+ *
+ * While the mailbox is enabled (sysconf.mailbox_depth is non-zero), received
+ * downlinks are stored in RAM instead of being sent to the host with +RECV.
+ * Once the configured number of downlinks is stored, the oldest downlink is
+ * dropped for each new one.
+ */
+unsigned int lrw_mailbox_count(void);
+
+
+/** @brief Return the number of downlinks dropped from a full mailbox
+ */
+uint32_t lrw_mailbox_dropped(void);
+
+
+/** @brief Return the oldest downlink in the mailbox without removing it
+ * @return A pointer to the downlink or NULL if the mailbox is empty
+ */
+const lrw_downlink_t *lrw_mailbox_peek(void);
+
+
+/** @brief Remove the oldest downlink from the mailbox
+ * @return Zero on success, -1 if the mailbox is empty
+ */
+int lrw_mailbox_drop(void);
+
 #endif // _LRW_H
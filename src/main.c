@@ -33,6 +33,7 @@ int main(void)
 
     nvm_init();
     cmd_init(sysconf.uart_baudrate);
+    lpuart_set_flow_control(sysconf.uart_flowctl);
 
     adc_init();
 
@@ -64,6 +65,7 @@ int main(void)
         process_uart_wakeup();
         #endif 
         cmd_process();
+        eeprom_process();
         lrw_process();
         sysconf_process();
 
@@ -12,7 +12,7 @@
 #include "part.h"
 #include "utils.h"
 
-#define NUMBER_OF_PARTS 9
+#define NUMBER_OF_PARTS 10
 
 
 /* The following partition sizes have been derived from the in-memory size of
@@ -32,6 +32,12 @@
 #define REGION2_PART_SIZE 1310
 #define CLASSB_PART_SIZE    32
 #define USER_NVM_PART_SIZE  72
+#define JOURNAL_PART_SIZE  480
+
+// The amount of free space to keep in the EEPROM when mirroring parts created
+// by older firmware, so that the largest mirrored part can still be relocated
+// by a future migration.
+#define MIGRATION_RESERVE PART_MIRRORED_SIZE(MAC2_PART_SIZE)
 
 
 // Make sure each data structure fits into its fixed-size partition
@@ -46,20 +52,41 @@ static_assert(sizeof(LoRaMacClassBNvmData_t) <= CLASSB_PART_SIZE, "ClassB NVM da
 static_assert(sizeof(user_nvm_t) <= USER_NVM_PART_SIZE, "User NVM data too long");
 
 
-// And also make sure that NVM data fits into the EEPROM twice. This is
-// useful in case we wanted to implement atomic writes or data mirroring.
+/* The frame counter journal is a ring of fixed-size records in its own part.
+ * Each record carries the uplink frame counter and the checksum of the crypto
+ * group snapshot stored in NVM at the time the record was written. Records
+ * that refer to a different snapshot are stale. Among the valid records, the
+ * one with the highest frame counter is the most recent one. The journal is
+ * never mirrored.
+ */
+typedef struct journal_record {
+    uint32_t fcnt_up;
+    uint32_t base;
+    uint32_t crc32;
+} journal_record_t;
+
+#define JOURNAL_RECORDS (JOURNAL_PART_SIZE / sizeof(journal_record_t))
+
+
+// And also make sure that all parts fit into the EEPROM. All parts except
+// for region2 and the frame counter journal are mirrored, i.e., stored twice,
+// so that a write interrupted by a reset or brown-out cannot corrupt them.
+// The region2 part is too large to be mirrored and LoRaMac can regenerate its
+// contents. The journal provides its own protection against torn writes.
 static_assert(
-    SYSCONF_PART_SIZE +
-    CRYPTO_PART_SIZE  +
-    MAC1_PART_SIZE    +
-    MAC2_PART_SIZE    +
-    SE_PART_SIZE      +
-    REGION1_PART_SIZE +
+    PART_TABLE_SIZE(NUMBER_OF_PARTS) +
+    PART_MIRRORED_SIZE(SYSCONF_PART_SIZE) +
+    PART_MIRRORED_SIZE(CRYPTO_PART_SIZE)  +
+    PART_MIRRORED_SIZE(MAC1_PART_SIZE)    +
+    PART_MIRRORED_SIZE(MAC2_PART_SIZE)    +
+    PART_MIRRORED_SIZE(SE_PART_SIZE)      +
+    PART_MIRRORED_SIZE(REGION1_PART_SIZE) +
     REGION2_PART_SIZE +
-    CLASSB_PART_SIZE  +
-    USER_NVM_PART_SIZE
-    <= (DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1 - PART_TABLE_SIZE(NUMBER_OF_PARTS)) / 2,
-    "NVM data does not fit into a single EEPROM bank");
+    PART_MIRRORED_SIZE(CLASSB_PART_SIZE)  +
+    PART_MIRRORED_SIZE(USER_NVM_PART_SIZE) +
+    JOURNAL_PART_SIZE
+    <= DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1,
+    "NVM data does not fit into the EEPROM");
 
 
 // We currently store all non-volatile state in the EEPROM, so there is only one
@@ -70,7 +97,8 @@ static_assert(
 static part_block_t nvm = {
     .size = DATA_EEPROM_BANK2_END - DATA_EEPROM_BASE + 1,
     .mmap = eeprom_mmap,
-    .write = eeprom_write
+    .write = eeprom_write,
+    .write_async = eeprom_write_async
 };
 
 struct nvm_parts nvm_parts;
@@ -86,19 +114,119 @@ sysconf_t sysconf = {
     .device_class = CLASS_A,
     .unconfirmed_retransmissions = 1,
     .confirmed_retransmissions = 8,
-    .appkey_readable = 1
+    .appkey_readable = 1,
+    .uart_flowctl = 0,
+    .txdone_urc = 0,
+    .uplink_handles = 0,
+    .mailbox_depth = 0,
+    .aggregation_window = 0
 };
 
 bool sysconf_modified;
 uint16_t nvm_flags;
 
+/* Each part has a schema version recorded in the partition table. Whenever the
+ * data structure stored in a part changes in a way that makes its existing
+ * contents unusable, increment the version and provide a migrate function that
+ * converts the contents. Parts are also migrated when their size changes. The
+ * migration keeps the contents, truncated or padded with zeroes, so that
+ * firmware updates do not erase the NVM and force every device to join again.
+ */
+typedef struct nvm_part_spec {
+    part_t *part;
+    const char *label;
+    size_t size;
+    uint32_t version;
+    bool mirrored;
+
+    // An optional part is left unused if it cannot be created or migrated
+    bool optional;
+
+    // Convert the contents of the part from the given older version. Invoked
+    // after the part has been resized. Return false if the contents cannot be
+    // converted, in which case the NVM is erased.
+    bool (*migrate)(part_t *part, uint32_t version);
+} nvm_part_spec_t;
+
+static const nvm_part_spec_t nvm_part_specs[] = {
+    { &nvm_parts.sysconf, "sysconf", SYSCONF_PART_SIZE,  0, true,  false, NULL },
+    { &nvm_parts.crypto,  "crypto",  CRYPTO_PART_SIZE,   0, true,  false, NULL },
+    { &nvm_parts.mac1,    "mac1",    MAC1_PART_SIZE,     0, true,  false, NULL },
+    { &nvm_parts.mac2,    "mac2",    MAC2_PART_SIZE,     0, true,  false, NULL },
+    { &nvm_parts.se,      "se",      SE_PART_SIZE,       0, true,  false, NULL },
+    { &nvm_parts.region1, "region1", REGION1_PART_SIZE,  0, true,  false, NULL },
+    { &nvm_parts.region2, "region2", REGION2_PART_SIZE,  0, false, false, NULL },
+    { &nvm_parts.classb,  "classb",  CLASSB_PART_SIZE,   0, true,  false, NULL },
+    { &nvm_parts.user,    "user",    USER_NVM_PART_SIZE, 0, true,  false, NULL },
+
+    // The frame counter journal is optional. Blocks formatted by older
+    // firmware have no room for another part. Those keep saving the frame
+    // counter with the rest of the crypto group.
+    { &nvm_parts.journal, "journal", JOURNAL_PART_SIZE,  0, false, true,  NULL }
+};
+
+// The record being written, the slot for the next record, and the frame
+// counter and crypto snapshot checksum of the most recent record
+static journal_record_t journal_record;
+static unsigned int journal_next;
+static uint32_t journal_fcnt;
+static uint32_t journal_base;
+
+
+/*
+ * Find the part described by spec, or create it if it does not exist yet. If
+ * the part exists, but its size, schema version, or mirroring differs from the
+ * spec, migrate the part to the spec while keeping its contents.
+ */
+static int open_part(const nvm_part_spec_t *spec)
+{
+    part_t *part = spec->part;
+
+    if (part_find(part, &nvm, spec->label)) {
+        if (part_create(part, &nvm, spec->label, spec->size, spec->version, spec->mirrored) == 0)
+            return 0;
+        goto failed;
+    }
+
+    uint32_t version = part_version(part);
+
+    // We cannot convert data written by newer firmware
+    if (version > spec->version) goto failed;
+
+    if (part_size(part) == spec->size && version == spec->version) {
+        // Parts created by older firmware are not mirrored. Mirror them only
+        // if enough free space remains to relocate the largest mirrored part
+        // in a future migration, otherwise keep using them as they are.
+        if (spec->mirrored && !part_is_mirrored(part)) {
+            if (part_free_space(&nvm) < PART_MIRRORED_SIZE(spec->size) + MIGRATION_RESERVE ||
+                part_migrate(part, spec->size, spec->version, true) != 0)
+                log_debug("No room to mirror NVM part %s", spec->label);
+        }
+        return 0;
+    }
+
+    log_debug("Migrating NVM part %s from version %ld (%d B) to version %ld (%d B)",
+        spec->label, version, part_size(part), spec->version, spec->size);
+    if (part_migrate(part, spec->size, spec->version, spec->mirrored) != 0) goto failed;
+    if (spec->migrate != NULL && !spec->migrate(part, version)) goto failed;
+    return 0;
+
+failed:
+    if (!spec->optional) return -1;
+
+    log_debug("No room for NVM part %s", spec->label);
+    memset(part, 0, sizeof(*part));
+    return 0;
+}
+
 
 /*
  * Initialize system configuration NVM (EEPROM) partition. If necessary, the
- * function formats the EEPROM if the part is not found, or reformats the EEPROM
- * if the part is found but has an invalid size. If the part is found and has a
- * matching size, check the CRC32 checksum of the data before using it. If the
- * checkum does not match, defaults will be used instead.
+ * function formats the EEPROM if the part is not found. Parts with a different
+ * size or schema version are migrated. The EEPROM is only reformatted if a
+ * part cannot be migrated. If the part is found and has a matching size, check
+ * the CRC32 checksum of the data before using it. If the checkum does not
+ * match, defaults will be used instead.
  */
 void nvm_init(void)
 {
@@ -114,50 +242,8 @@ start:
         if (part_open_block(&nvm) != 0) halt("EEPROM I/O error");
     }
 
-    if ((part_find(&nvm_parts.sysconf, &nvm, "sysconf") &&
-        part_create(&nvm_parts.sysconf, &nvm, "sysconf", SYSCONF_PART_SIZE)) ||
-        nvm_parts.sysconf.dsc->size != SYSCONF_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.crypto, &nvm, "crypto") &&
-        part_create(&nvm_parts.crypto, &nvm, "crypto", CRYPTO_PART_SIZE)) ||
-        nvm_parts.crypto.dsc->size != CRYPTO_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.mac1, &nvm, "mac1") &&
-        part_create(&nvm_parts.mac1, &nvm, "mac1", MAC1_PART_SIZE)) ||
-        nvm_parts.mac1.dsc->size != MAC1_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.mac2, &nvm, "mac2") &&
-        part_create(&nvm_parts.mac2, &nvm, "mac2", MAC2_PART_SIZE)) ||
-        nvm_parts.mac2.dsc->size != MAC2_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.se, &nvm, "se") &&
-        part_create(&nvm_parts.se, &nvm, "se", SE_PART_SIZE)) ||
-        nvm_parts.se.dsc->size != SE_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.region1, &nvm, "region1") &&
-        part_create(&nvm_parts.region1, &nvm, "region1", REGION1_PART_SIZE)) ||
-        nvm_parts.region1.dsc->size != REGION1_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.region2, &nvm, "region2") &&
-        part_create(&nvm_parts.region2, &nvm, "region2", REGION2_PART_SIZE)) ||
-        nvm_parts.region2.dsc->size != REGION2_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.classb, &nvm, "classb") &&
-        part_create(&nvm_parts.classb, &nvm, "classb", CLASSB_PART_SIZE)) ||
-        nvm_parts.classb.dsc->size != CLASSB_PART_SIZE)
-        goto retry;
-
-    if ((part_find(&nvm_parts.user, &nvm, "user") &&
-        part_create(&nvm_parts.user, &nvm, "user", USER_NVM_PART_SIZE)) ||
-        nvm_parts.user.dsc->size != USER_NVM_PART_SIZE)
-        goto retry;
+    for (unsigned int i = 0; i < ARRAY_LEN(nvm_part_specs); i++)
+        if (open_part(&nvm_part_specs[i]) != 0) goto retry;
 
     size_t size;
     const uint8_t *p = part_mmap(&size, &nvm_parts.sysconf);
@@ -193,6 +279,12 @@ retry:
 
 int nvm_erase(void)
 {
+    // Let background writes finish first. A mirrored part is written in
+    // several steps, each started from the callback of the previous one, and
+    // the remaining steps would otherwise land in the erased block.
+    while (part_write_pending(&nvm) || eeprom_write_pending())
+        eeprom_process();
+
     // Erase the contents of the block (and all its parts) and close it
     // immediately so that further operations such as read and write would fail
     // until the block is opened and formatted again.
@@ -202,6 +294,74 @@ int nvm_erase(void)
 }
 
 
+bool nvm_journal_replay(LoRaMacCryptoNvmData_t *crypto)
+{
+    size_t size;
+    const journal_record_t *r = part_mmap(&size, &nvm_parts.journal);
+    bool found = false;
+
+    journal_next = 0;
+    journal_fcnt = 0;
+    journal_base = crypto->Crc32;
+    if (r == NULL) return false;
+
+    for (unsigned int i = 0; i < JOURNAL_RECORDS; i++) {
+        if (r[i].base != crypto->Crc32 || !check_block_crc(&r[i], sizeof(r[i])))
+            continue;
+
+        if (!found || r[i].fcnt_up > journal_fcnt) {
+            journal_fcnt = r[i].fcnt_up;
+            journal_next = (i + 1) % JOURNAL_RECORDS;
+            found = true;
+        }
+    }
+
+    if (!found || journal_fcnt <= crypto->FCntList.FCntUp) return false;
+
+    log_debug("Restoring uplink frame counter %lu from journal", journal_fcnt);
+    crypto->FCntList.FCntUp = journal_fcnt;
+    return true;
+}
+
+
+bool nvm_journal_append(const LoRaMacCryptoNvmData_t *crypto, void (*callback)(bool success))
+{
+    size_t size;
+    const LoRaMacCryptoNvmData_t *stored = part_mmap(&size, &nvm_parts.crypto);
+    if (stored == NULL || nvm_parts.journal.dsc == NULL) return false;
+
+    // A full write of the crypto group starts a new epoch of the journal
+    if (journal_base != stored->Crc32) {
+        journal_base = stored->Crc32;
+        journal_fcnt = 0;
+    }
+
+    // Only a frame counter that grows can be journaled. Any other change, e.g.,
+    // a new DevNonce after Join, requires the entire group to be written.
+    if (crypto->FCntList.FCntUp <= stored->FCntList.FCntUp ||
+        crypto->FCntList.FCntUp <= journal_fcnt)
+        return false;
+
+    LoRaMacCryptoNvmData_t c;
+    memcpy(&c, crypto, sizeof(c));
+    c.FCntList.FCntUp = stored->FCntList.FCntUp;
+    c.Crc32 = stored->Crc32;
+    if (memcmp(&c, stored, sizeof(c))) return false;
+
+    journal_record.fcnt_up = crypto->FCntList.FCntUp;
+    journal_record.base = stored->Crc32;
+    update_block_crc(&journal_record, sizeof(journal_record));
+
+    if (!part_write_async(&nvm_parts.journal, journal_next * sizeof(journal_record),
+        &journal_record, sizeof(journal_record), callback))
+        return false;
+
+    journal_fcnt = journal_record.fcnt_up;
+    journal_next = (journal_next + 1) % JOURNAL_RECORDS;
+    return true;
+}
+
+
 void sysconf_process(void)
 {
     if (!sysconf_modified) return;
@@ -2,6 +2,7 @@
 #define _NVM_H_
 
 #include "part.h"
+#include <loramac-node/src/mac/LoRaMac.h>
 
 
 /* The sysconf data structure is meant to be used for platform configuration
@@ -12,7 +13,9 @@
 typedef struct sysconf
 {
     /* The baud rate to be used by the ATCI UART interface. The following values
-     * are supported: 1200, 2400, 4800, 9600, 19200, 38400.
+     * are supported: 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200,
+     * 230400, 460800. Baud rates up to 9600 are clocked from LSE, higher baud
+     * rates from HSI16 (see lpuart.c).
      */
     unsigned int uart_baudrate;
 
@@ -58,6 +61,45 @@ typedef struct sysconf
      */
     uint8_t appkey_readable:1;
 
+    /* Enable RTS/CTS hardware flow control on the ATCI UART interface. Set to 1
+     * to enable, set to 0 to disable.
+     */
+    uint8_t uart_flowctl:1;
+
+    /* Report the completion of each uplink to the client with a +TXDONE
+     * message that carries the frame counter, data rate, channel, TX power,
+     * time on air, and the number of transmissions. Set to 1 to enable, set to
+     * 0 to disable.
+     */
+    uint8_t txdone_urc:1;
+
+    /* Respond to AT+UTX and AT+CTX with the handle of the uplink and tag +ACK
+     * and +NOACK with the handle, so that the client can keep multiple uplinks
+     * in flight. The original Type ABZ firmware does not use handles. Set to 1
+     * to enable, set to 0 to disable.
+     */
+    uint8_t uplink_handles:1;
+
+    /* The maximum number of received downlinks stored in the downlink mailbox.
+     * Set to 0 to send downlinks to the client with +RECV as they arrive. Any
+     * other value suppresses +RECV and the client polls for downlinks with
+     * AT$RECV. The mailbox memory (LRW_MAILBOX_SIZE) may fill up with fewer
+     * downlinks, in which case the oldest downlinks are dropped as well. The
+     * field occupies former padding, thus configurations stored by older
+     * firmware read as 0.
+     */
+    uint8_t mailbox_depth;
+
+    /* The time (in milliseconds) for which an uplink queued with AT$QTX waits
+     * for further uplinks to the same port so that they can be sent together
+     * in one frame. With a non-zero value, each queued uplink is sent with a
+     * one-byte length prefix, also if it is the only one in the frame. Set to
+     * 0 to send each queued uplink in a frame of its own without the prefix.
+     * The field occupies former padding, thus configurations stored by older
+     * firmware read as 0.
+     */
+    uint16_t aggregation_window;
+
     uint32_t crc32;
 } sysconf_t;
 
@@ -72,6 +114,7 @@ struct nvm_parts {
     part_t region2;
     part_t classb;
     part_t user;
+    part_t journal;
 };
 
 #define USER_NVM_MAX_SIZE   64     // maximum allows values inside the User Nvm area
@@ -93,6 +136,23 @@ void nvm_init(void);
 
 int nvm_erase(void);
 
+/* Restore the uplink frame counter from the frame counter journal. The
+ * function must be called with the crypto group loaded from NVM, before the
+ * group is handed over to LoRaMac. Returns true if the frame counter in the
+ * group has been updated, in which case the caller needs to update the
+ * checksum of the group.
+ */
+bool nvm_journal_replay(LoRaMacCryptoNvmData_t *crypto);
+
+/* Record the uplink frame counter of the crypto group in the next slot of the
+ * frame counter journal instead of rewriting the entire group in place. This
+ * spreads EEPROM wear caused by frequent uplinks over the journal. Returns
+ * false if the group has other changes (or the journal is unavailable) and
+ * needs to be written in full. Otherwise, the record is written in the
+ * background and the callback is invoked once it has been written.
+ */
+bool nvm_journal_append(const LoRaMacCryptoNvmData_t *crypto, void (*callback)(bool success));
+
 void sysconf_process(void);
 void user_nvm_process(void);
 
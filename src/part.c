@@ -1,6 +1,8 @@
 #include "part.h"
 #include <string.h>
+#include "crc32.h"
 #include "log.h"
+#include "utils.h"
 
 #define PART_BLOCK_SIGNATURE ((uint32_t)0x1ABE11ED)
 
@@ -10,6 +12,182 @@
 
 #define BLOCK_CLOSED(b) ((b) == NULL || (b)->table == NULL || (b)->parts == NULL)
 
+#define RAW_SIZE(d) ((d)->size & ~PART_MIRRORED)
+#define IS_MIRRORED(d) (((d)->size & PART_MIRRORED) != 0)
+#define COPY_SIZE(d) (RAW_SIZE(d) / 2)
+#define DATA_SIZE(d) (IS_MIRRORED(d) ? COPY_SIZE(d) - sizeof(part_trailer_t) : RAW_SIZE(d))
+
+
+// A write of a mirrored part consists of up to four segments written into the
+// inactive copy: the data preceding the written range (taken from the active
+// copy), the written range, the data following the written range (again from
+// the active copy), and the trailer. A background write proceeds segment by
+// segment from the completion callback.
+#define SEGMENTS 4
+
+typedef struct mirror_write {
+    part_t *part;
+    uint32_t start[SEGMENTS];
+    const void *data[SEGMENTS];
+    size_t length[SEGMENTS];
+    part_trailer_t trailer;
+} mirror_write_t;
+
+static struct {
+    mirror_write_t w;
+    unsigned int segment;
+    void (*callback)(bool success);
+    bool busy;
+} job;
+
+
+static uint32_t copy_start(const part_t *part, unsigned int copy)
+{
+    return part->dsc->start + copy * COPY_SIZE(part->dsc);
+}
+
+
+// Determine the active copy of a mirrored part: the valid copy with the newer
+// sequence number. If neither copy is valid, the part has not been written
+// yet and copy 0 is used.
+static void select_copy(part_t *part)
+{
+    part_trailer_t t[2];
+    bool valid[2];
+
+    part->active = 0;
+    part->seq = 0;
+    if (!IS_MIRRORED(part->dsc)) return;
+
+    for (unsigned int i = 0; i < 2; i++) {
+        const uint8_t *p = part->block->mmap(copy_start(part, i), COPY_SIZE(part->dsc));
+        valid[i] = check_block_crc(p, COPY_SIZE(part->dsc));
+        if (valid[i]) memcpy(&t[i], p + DATA_SIZE(part->dsc), sizeof(t[i]));
+    }
+
+    if (valid[0] && (!valid[1] || (int32_t)(t[0].seq - t[1].seq) >= 0)) {
+        part->seq = t[0].seq;
+    } else if (valid[1]) {
+        part->active = 1;
+        part->seq = t[1].seq;
+    }
+}
+
+
+static bool prepare_mirror_write(mirror_write_t *w, part_t *part, uint32_t address, const void *buffer, size_t length)
+{
+    const uint32_t size = DATA_SIZE(part->dsc);
+    const uint8_t *active = part->block->mmap(copy_start(part, part->active), size);
+    uint32_t target = copy_start(part, !part->active);
+
+    if (active == NULL) return false;
+
+    w->part = part;
+
+    w->start[0] = target;
+    w->data[0] = active;
+    w->length[0] = address;
+
+    w->start[1] = target + address;
+    w->data[1] = buffer;
+    w->length[1] = length;
+
+    w->start[2] = target + address + length;
+    w->data[2] = active + address + length;
+    w->length[2] = size - address - length;
+
+    w->trailer.seq = part->seq + 1;
+
+    uint32_t crc = CRC32_INIT;
+    for (unsigned int i = 0; i < 3; i++)
+        crc = crc32_update(crc, w->data[i], w->length[i]);
+    crc = crc32_update(crc, &w->trailer.seq, sizeof(w->trailer.seq));
+    w->trailer.crc32 = ~crc;
+
+    w->start[3] = target + size;
+    w->data[3] = &w->trailer;
+    w->length[3] = sizeof(w->trailer);
+    return true;
+}
+
+
+// Make the freshly written copy active, provided that it is valid. The copy
+// would not be valid if the source buffer changed while it was being written.
+static bool finish_mirror_write(mirror_write_t *w)
+{
+    part_t *part = w->part;
+    unsigned int copy = !part->active;
+
+    const void *p = part->block->mmap(copy_start(part, copy), COPY_SIZE(part->dsc));
+    if (!check_block_crc(p, COPY_SIZE(part->dsc))) return false;
+
+    part->active = copy;
+    part->seq = w->trailer.seq;
+    return true;
+}
+
+
+static void mirror_write_next(bool success)
+{
+    const part_block_t *block = job.w.part->block;
+
+    while (success && ++job.segment < SEGMENTS) {
+        if (job.w.length[job.segment] == 0) continue;
+        if (block->write_async(job.w.start[job.segment], job.w.data[job.segment],
+            job.w.length[job.segment], mirror_write_next))
+            return;
+        success = false;
+    }
+
+    if (success) success = finish_mirror_write(&job.w);
+
+    // The callback may start another write
+    job.busy = false;
+    if (job.callback != NULL) job.callback(success);
+}
+
+
+// Calculate the offset of the first aligned byte following all parts, i.e.,
+// the beginning of the free space at the end of the block. Since migrated parts
+// can be relocated, the last part in the table is not necessarily the one that
+// ends last.
+static uint32_t free_space_start(const part_block_t *block)
+{
+    uint32_t end = block->table->size;
+
+    for (unsigned int i = 0; i < block->table->num_parts; i++) {
+        const part_dsc_t *p = &block->parts[i];
+        if (p->start + RAW_SIZE(p) > end) end = p->start + RAW_SIZE(p);
+    }
+
+    return PART_ALIGN(end);
+}
+
+
+// Write the first length bytes of data to the given address and fill the rest
+// of size bytes with zeroes. The data must not overlap with the destination.
+// If crc is not NULL, the function updates the CRC32 checksum of the written
+// bytes.
+static bool copy_data(const part_block_t *block, uint32_t address, const uint8_t *data, size_t length, size_t size, uint32_t *crc)
+{
+    static const uint32_t zero = 0;
+
+    if (length > size) length = size;
+
+    if (length) {
+        if (!block->write(address, data, length)) return false;
+        if (crc) *crc = crc32_update(*crc, data, length);
+    }
+
+    for (size_t i = length; i < size; i += sizeof(zero)) {
+        size_t n = size - i < sizeof(zero) ? size - i : sizeof(zero);
+        if (!block->write(address + i, &zero, n)) return false;
+        if (crc) *crc = crc32_update(*crc, &zero, n);
+    }
+
+    return true;
+}
+
 
 int part_erase_block(part_block_t *block)
 {
@@ -17,6 +195,10 @@ int part_erase_block(part_block_t *block)
 
     if (block->size < FIXED_PART_TABLE_SIZE || block->write == NULL) return -2;
 
+    // A background write would resume after the erase and write the rest of
+    // its part over the erased block
+    if (part_write_pending(block)) return -4;
+
     log_debug("part: Erasing block %p (%d B)", (void *)block, block->size);
     uint32_t sig = EMPTY;
     block->write(block->start, &sig, sizeof(sig));
@@ -118,6 +300,7 @@ int part_find(part_t *part, const part_block_t *block, const char *label)
         if (memcmp(block->parts[i].label, label, len)) continue;
         part->block = block;
         part->dsc = block->parts + i;
+        select_copy(part);
         return 0;
     }
 
@@ -125,7 +308,7 @@ int part_find(part_t *part, const part_block_t *block, const char *label)
 }
 
 
-int part_create(part_t *part, const part_block_t *block, const char *label, size_t size)
+int part_create(part_t *part, const part_block_t *block, const char *label, size_t size, uint32_t version, bool mirrored)
 {
     if (BLOCK_CLOSED(block)) return -1;
 
@@ -139,28 +322,27 @@ int part_create(part_t *part, const part_block_t *block, const char *label, size
     if (block->table->num_parts >= MAX_PARTS(block->table))
         return -4;
 
-    // Calculate the offset of the first aligned byte where a new partition can
-    // start. The new partition will only be created following the current last
-    // partition.
+    // The data in each copy of a mirrored part must end on an aligned
+    // boundary so that the size can be derived from the partition table.
+    if (mirrored && size != PART_ALIGN(size))
+        return -3;
 
-    uint32_t first_aligned_byte;
+    uint32_t raw_size = mirrored ? PART_MIRRORED_SIZE(size) : size;
 
-    if (block->table->num_parts > 0) {
-        const part_dsc_t *last_part = &block->parts[block->table->num_parts - 1];
-        first_aligned_byte = PART_ALIGN(last_part->start + last_part->size);
-    } else {
-        first_aligned_byte = PART_ALIGN(block->table->size);
-    }
+    // The new partition will only be created following the current last
+    // partition.
+    uint32_t first_aligned_byte = free_space_start(block);
 
     // Make sure that there is enough space in the block for the new partition
-    if (first_aligned_byte + size > block->size)
+    if (first_aligned_byte + raw_size > block->size)
         return -5;
 
     // Create a new partition record structure and write it into the
     // corresponding place in the array of partitions.
     part_dsc_t p = {
         .start = first_aligned_byte,
-        .size = size
+        .size = mirrored ? raw_size | PART_MIRRORED : raw_size,
+        .version = version
     };
     memcpy(p.label, label, len + 1);
     if (!block->write(block->start + FIXED_PART_TABLE_SIZE + block->table->num_parts * sizeof(part_dsc_t),
@@ -173,11 +355,13 @@ int part_create(part_t *part, const part_block_t *block, const char *label, size
     if (!block->write(block->start, &table, sizeof(table)))
         return -7;
 
-    log_debug("part: Created part '%s' in block %p starting at offset %ld (%d B)",
-        label, (void *)block, first_aligned_byte, size);
+    log_debug("part: Created %spart '%s' in block %p starting at offset %ld (%ld B)",
+        mirrored ? "mirrored " : "", label, (void *)block, first_aligned_byte, raw_size);
 
     part->block = block;
     part->dsc = block->parts + table.num_parts - 1;
+    part->active = 0;
+    part->seq = 0;
     return 0;
 }
 
@@ -190,36 +374,226 @@ int part_dump_block(part_block_t *block)
         block->table->num_parts, MAX_PARTS(block->table));
 
     for (int i = 0; i < block->table->num_parts; i++) {
-        log_debug("part:   Part '%s' at offset %ld (%ld B)", block->parts[i].label,
-            block->parts[i].start, block->parts[i].size);
+        log_debug("part:   Part '%s' at offset %ld (%ld B)%s", block->parts[i].label,
+            block->parts[i].start, RAW_SIZE(&block->parts[i]),
+            IS_MIRRORED(&block->parts[i]) ? ", mirrored" : "");
     }
 
     return 0;
 }
 
 
-bool part_write(const part_t *part, uint32_t address, const void *buffer, size_t length)
+size_t part_size(const part_t *part)
+{
+    if (part == NULL || part->dsc == NULL) return 0;
+    return DATA_SIZE(part->dsc);
+}
+
+
+uint32_t part_version(const part_t *part)
+{
+    if (part == NULL || part->dsc == NULL) return 0;
+    return part->dsc->version;
+}
+
+
+bool part_is_mirrored(const part_t *part)
+{
+    if (part == NULL || part->dsc == NULL) return false;
+    return IS_MIRRORED(part->dsc);
+}
+
+
+/* Change the size, schema version, or mirroring of an existing part while
+ * keeping its contents. Data beyond the new size is dropped, bytes beyond the
+ * old size are filled with zeroes. The part is changed in place if the new
+ * layout fits into the space the part occupies, or if the part ends last
+ * and can grow into the free space that follows it. Otherwise, the data is
+ * copied into the free space at the end of the block and the space the part
+ * occupied before is abandoned.
+ *
+ * If there is not enough free space to relocate the part, the part is
+ * rewritten in place without mirroring as long as the data fits into the
+ * space the part occupies (or the part ends last). The caller can check with
+ * part_is_mirrored whether the part ended up mirrored.
+ *
+ * The descriptor in the partition table is updated last, once the data is in
+ * place. Any further transformation of the data is up to the caller.
+ */
+int part_migrate(part_t *part, size_t size, uint32_t version, bool mirrored)
+{
+    if (part == NULL || BLOCK_CLOSED(part->block)) return -1;
+
+    const part_block_t *block = part->block;
+    if (block->write == NULL) return -2;
+
+    if (mirrored && size != PART_ALIGN(size)) return -3;
+
+    uint32_t raw_size = mirrored ? PART_MIRRORED_SIZE(size) : size;
+    size_t old_size = DATA_SIZE(part->dsc);
+    uint32_t old_start = copy_start(part, part->active);
+    const uint8_t *old = block->mmap(old_start, old_size);
+    if (old == NULL) return -4;
+
+    unsigned int index = part->dsc - block->parts;
+    bool last = PART_ALIGN(part->dsc->start + RAW_SIZE(part->dsc)) == free_space_start(block);
+
+    // Only a non-mirrored part can be resized in place, since resizing a
+    // mirrored part would move its second copy.
+    bool in_place = mirrored == IS_MIRRORED(part->dsc) && (raw_size == RAW_SIZE(part->dsc) ||
+        (!mirrored && (raw_size < RAW_SIZE(part->dsc) || last)));
+
+    if (!in_place && free_space_start(block) + raw_size > block->size) {
+        if (size > RAW_SIZE(part->dsc) && !last) return -5;
+        log_warning("part: No room to relocate part '%s', migrating it in place without mirroring",
+            part->dsc->label);
+        mirrored = false;
+        raw_size = size;
+        in_place = true;
+    }
+
+    part_dsc_t d;
+    memcpy(&d, part->dsc, sizeof(d));
+    d.size = mirrored ? raw_size | PART_MIRRORED : raw_size;
+    d.version = version;
+
+    if (in_place) {
+        if (d.start + raw_size > block->size) return -5;
+        if (old_start != d.start) {
+            // The active copy of a mirrored part moves to the beginning of
+            // the part. The copy runs forward and the destination precedes
+            // the source, so it does not overwrite data it has yet to read.
+            if (!copy_data(block, d.start, old, old_size, size, NULL)) return -6;
+        } else if (size > old_size) {
+            if (!copy_data(block, d.start + old_size, NULL, 0, size - old_size, NULL))
+                return -6;
+        }
+    } else {
+        d.start = free_space_start(block);
+
+        if (mirrored) {
+            // Write the data into the first copy with sequence number 1 and
+            // invalidate the second copy
+            part_trailer_t t = { .seq = 1 };
+            uint32_t crc = CRC32_INIT;
+            uint32_t empty = EMPTY;
+
+            if (!copy_data(block, d.start, old, old_size, size, &crc)) return -6;
+            crc = crc32_update(crc, &t.seq, sizeof(t.seq));
+            t.crc32 = ~crc;
+            if (!block->write(d.start + size, &t, sizeof(t))) return -6;
+            if (!block->write(d.start + raw_size - sizeof(empty), &empty, sizeof(empty))) return -6;
+        } else {
+            if (!copy_data(block, d.start, old, old_size, size, NULL)) return -6;
+        }
+    }
+
+    if (!block->write(block->start + FIXED_PART_TABLE_SIZE + index * sizeof(part_dsc_t), &d, sizeof(d)))
+        return -7;
+
+    log_debug("part: Migrated %spart '%s' to offset %ld (%ld B), version %ld",
+        mirrored ? "mirrored " : "", d.label, d.start, raw_size, version);
+
+    select_copy(part);
+    return 0;
+}
+
+
+/* Return the number of bytes available for new parts or for parts relocated
+ * by part_migrate at the end of the block.
+ */
+size_t part_free_space(const part_block_t *block)
+{
+    if (BLOCK_CLOSED(block)) return 0;
+
+    uint32_t start = free_space_start(block);
+    return start < block->size ? block->size - start : 0;
+}
+
+
+// Check whether the background write job is writing the given part
+static bool job_writes(const part_t *part)
+{
+    return job.busy && job.w.part->dsc == part->dsc;
+}
+
+
+bool part_write_pending(const part_block_t *block)
+{
+    return job.busy && job.w.part->block == block;
+}
+
+
+bool part_write(part_t *part, uint32_t address, const void *buffer, size_t length)
+{
+    mirror_write_t w;
+
+    if (part == NULL || BLOCK_CLOSED(part->block)) return false;
+
+    if (address + length > DATA_SIZE(part->dsc)) return false;
+
+    // The background write would finish later and make its copy active,
+    // overriding the data written here
+    if (job_writes(part)) return false;
+
+    if (!IS_MIRRORED(part->dsc))
+        return part->block->write(part->dsc->start + address, buffer, length);
+
+    if (!prepare_mirror_write(&w, part, address, buffer, length)) return false;
+
+    for (unsigned int i = 0; i < SEGMENTS; i++) {
+        if (w.length[i] == 0) continue;
+        if (!part->block->write(w.start[i], w.data[i], w.length[i])) return false;
+    }
+
+    return finish_mirror_write(&w);
+}
+
+
+bool part_write_async(part_t *part, uint32_t address, const void *buffer, size_t length, void (*callback)(bool success))
 {
     if (part == NULL || BLOCK_CLOSED(part->block)) return false;
 
-    if (address + length > part->dsc->size) return false;
-    return part->block->write(part->dsc->start + address, buffer, length);
+    if (address + length > DATA_SIZE(part->dsc)) return false;
+    if (part->block->write_async == NULL) return false;
+
+    if (!IS_MIRRORED(part->dsc))
+        return part->block->write_async(part->dsc->start + address, buffer, length, callback);
+
+    // The block can only run one background write at a time, thus a single
+    // job is enough. The data from the active copy is written from its memory
+    // mapping, which remains unchanged until the write has finished. The job
+    // must not be touched while a previous write is still using it.
+    if (job.busy) return false;
+    if (!prepare_mirror_write(&job.w, part, address, buffer, length)) return false;
+    job.callback = callback;
+
+    for (job.segment = 0; job.segment < SEGMENTS; job.segment++) {
+        if (job.w.length[job.segment] == 0) continue;
+        job.busy = part->block->write_async(job.w.start[job.segment], job.w.data[job.segment],
+            job.w.length[job.segment], mirror_write_next);
+        return job.busy;
+    }
+    return false;
 }
 
 
-bool part_erase(const part_t *part)
+bool part_erase(part_t *part)
 {
     int rv = 1;
     uint32_t v = EMPTY;
 
     if (part == NULL || BLOCK_CLOSED(part->block)) return false;
+    if (job_writes(part)) return false;
     log_debug("part: Erasing part %s", part->dsc->label);
 
-    for (unsigned int i = 0; i < part->dsc->size; i += sizeof(v)) {
+    for (unsigned int i = 0; i < RAW_SIZE(part->dsc); i += sizeof(v)) {
         rv &= part->block->write(part->dsc->start + i, &v,
-            (part->dsc->size - i) >= sizeof(v) ? sizeof(v) : (part->dsc->size - i));
+            (RAW_SIZE(part->dsc) - i) >= sizeof(v) ? sizeof(v) : (RAW_SIZE(part->dsc) - i));
     }
 
+    part->active = 0;
+    part->seq = 0;
     return rv == 1;
 }
 
@@ -228,6 +602,6 @@ const void *part_mmap(size_t *size, const part_t *part)
 {
     if (part == NULL || BLOCK_CLOSED(part->block)) return NULL;
 
-    *size = part->dsc->size;
-    return part->block->mmap(part->dsc->start, part->dsc->size);
+    *size = DATA_SIZE(part->dsc);
+    return part->block->mmap(copy_start(part, part->active), DATA_SIZE(part->dsc));
 }
@@ -5,7 +5,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 
-#define MAX_LABEL_SIZE 16
+#define MAX_LABEL_SIZE 12
 
 #define PART_ALIGNMENT 4
 #define PART_ALIGN(v) (((v) + PART_ALIGNMENT - 1) / PART_ALIGNMENT * PART_ALIGNMENT)
@@ -14,17 +14,36 @@
 #define VARIABLE_PART_TABLE_SIZE(n) ((n) * PART_ALIGN(sizeof(part_dsc_t)))
 #define PART_TABLE_SIZE(n) (FIXED_PART_TABLE_SIZE + VARIABLE_PART_TABLE_SIZE((n)))
 
+// A mirrored part has the most significant bit of its size set in the
+// partition table. The part consists of two copies, each with the data followed
+// by a part_trailer_t. Writes always go to the inactive copy, which becomes the
+// active copy once it has been written completely. Parts created by older
+// firmware are never mirrored.
+#define PART_MIRRORED 0x80000000UL
+#define PART_MIRRORED_SIZE(size) (2 * (PART_ALIGN(size) + sizeof(part_trailer_t)))
 
+
+// The version field occupies what used to be the last four bytes of the label.
+// Those were always zero, thus parts created by older firmware have version 0.
 typedef struct part_dsc {
     uint32_t start;
     uint32_t size;
     char label[MAX_LABEL_SIZE];
+    uint32_t version;  // Schema version of the data stored in the part
 } part_dsc_t;
 
 
+typedef struct part_trailer {
+    uint32_t seq;    // Sequence number, incremented with each write of the part
+    uint32_t crc32;  // CRC32 checksum of the copy's data and the sequence number
+} part_trailer_t;
+
+
 typedef struct part {
     const struct part_block *block;
     const part_dsc_t *dsc;
+    uint8_t active;  // The copy with the most recent data (mirrored parts only)
+    uint32_t seq;    // The sequence number of the active copy
 } part_t;
 
 
@@ -41,6 +60,7 @@ typedef struct part_block {
     const part_table_t *table;  // A mmaped pointer to the partition table
     const part_dsc_t *parts;    // A mmaped pointer to the partition array
     bool (*write)(uint32_t address, const void *buffer, size_t length);
+    bool (*write_async)(uint32_t address, const void *buffer, size_t length, void (*callback)(bool success));
     const void *(*mmap)(uint32_t address, size_t length);
 } part_block_t;
 
@@ -51,11 +71,18 @@ int part_open_block(part_block_t *block);
 void part_close_block(part_block_t *block);
 
 int part_find(part_t *part, const part_block_t *block, const char *label);
-int part_create(part_t *part, const part_block_t *block, const char *label, size_t size);
-
-bool part_write(const part_t *part, uint32_t address, const void *buffer, size_t length);
+int part_create(part_t *part, const part_block_t *block, const char *label, size_t size, uint32_t version, bool mirrored);
+int part_migrate(part_t *part, size_t size, uint32_t version, bool mirrored);
+size_t part_size(const part_t *part);
+uint32_t part_version(const part_t *part);
+bool part_is_mirrored(const part_t *part);
+size_t part_free_space(const part_block_t *block);
+
+bool part_write(part_t *part, uint32_t address, const void *buffer, size_t length);
+bool part_write_async(part_t *part, uint32_t address, const void *buffer, size_t length, void (*callback)(bool success));
+bool part_write_pending(const part_block_t *block);
 const void *part_mmap(size_t *size, const part_t *part);
-bool part_erase(const part_t *part);
+bool part_erase(part_t *part);
 
 int part_dump_block(part_block_t *block);
 
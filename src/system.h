@@ -33,7 +33,8 @@ typedef enum
     SYSTEM_MODULE_RADIO     = (1 << 4),
     SYSTEM_MODULE_ATCI      = (1 << 5),
     SYSTEM_MODULE_NVM       = (1 << 6),
-    SYSTEM_MODULE_LORA      = (1 << 7)
+    SYSTEM_MODULE_LORA      = (1 << 7),
+    SYSTEM_MODULE_EEPROM    = (1 << 8)
 } system_module_t;
 
 
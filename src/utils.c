@@ -1,7 +1,7 @@
 #include "utils.h"
 #include <stdint.h>
 #include <string.h>
-#include <LoRaWAN/Utilities/utilities.h>
+#include "crc32.h"
 
 
 bool check_block_crc(const void *ptr, size_t size)
@@ -16,15 +16,7 @@ bool check_block_crc(const void *ptr, size_t size)
     // isn't properly aligned.
     memcpy(&crc, (uint8_t *)ptr + len, sizeof(crc));
 
-    uint32_t s = Crc32Init();
-
-    for (unsigned int i = 0; i < len;) {
-        // Crc32Update only accepts blocks up to UINT16_MAX
-        s = Crc32Update(s, (uint8_t *)ptr + i, (len - i) > UINT16_MAX ? UINT16_MAX : len);
-        i += (len - i) > UINT16_MAX ? UINT16_MAX : len;
-    }
-
-    return Crc32Finalize(s) == crc;
+    return ~crc32_update(CRC32_INIT, ptr, len) == crc;
 }
 
 
@@ -38,15 +30,7 @@ bool update_block_crc(const void *ptr, size_t size)
 
     memcpy(&old, (uint8_t *)ptr + len, sizeof(old));
 
-    uint32_t s = Crc32Init();
-
-    for (unsigned int i = 0; i < len;) {
-        // Crc32Update only accepts blocks up to UINT16_MAX
-        s = Crc32Update(s, (uint8_t *)ptr + i, (len - i) > UINT16_MAX ? UINT16_MAX : len);
-        i += (len - i) > UINT16_MAX ? UINT16_MAX : len;
-    }
-
-    new = Crc32Finalize(s);
+    new = ~crc32_update(CRC32_INIT, ptr, len);
 
     if (old != new) {
         memcpy((uint8_t *)ptr + len, &new, sizeof(new));
@@ -0,0 +1,24 @@
+// Helpers shared by the host benchmark programs
+
+#ifndef __TEST_BENCH_H__
+#define __TEST_BENCH_H__
+
+#include <time.h>
+
+
+static inline double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Keep the compiler from optimizing away computations whose results are
+// otherwise unused
+static inline void bench_use(const void *p)
+{
+    __asm__ volatile("" : : "r"(p) : "memory");
+}
+
+#endif // __TEST_BENCH_H__
@@ -0,0 +1,108 @@
+// A host benchmark of AT command lookup. It compares the FNV-1a hash table
+// lookup from src/atci.c with the previous linear scan that called strlen and
+// strncmp on every entry of the command table. The table below has the same
+// command names as src/cmd.c. Each iteration looks up every command, as a read
+// command line (e.g. "+DR?"), plus one unknown command. Run with "make bench".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "atci.h"
+#include "bench.h"
+
+#define ITERATIONS 20000
+
+#define CMD(name) { name, NULL, NULL, NULL, NULL, "" }
+
+static const atci_command_t commands[] = {
+    CMD("+UART"), CMD("+VER"), CMD("+DEV"), CMD("+REBOOT"), CMD("+FACNEW"),
+    CMD("+BAND"), CMD("+CLASS"), CMD("+MODE"), CMD("+DEVADDR"), CMD("+DEVEUI"),
+    CMD("+APPEUI"), CMD("+NWKSKEY"), CMD("+APPSKEY"), CMD("+APPKEY"),
+    CMD("+JOIN"), CMD("+JOINDC"), CMD("+LNCHECK"), CMD("+RFPARAM"),
+    CMD("+RFPOWER"), CMD("+NWK"), CMD("+ADR"), CMD("+DR"), CMD("+DELAY"),
+    CMD("+ADRACK"), CMD("+RX2"), CMD("+DUTYCYCLE"), CMD("+SLEEP"),
+    CMD("+PORT"), CMD("+REP"), CMD("+DFORMAT"), CMD("+TO"), CMD("+UTX"),
+    CMD("+CTX"), CMD("+MCAST"), CMD("+PUTX"), CMD("+PCTX"), CMD("+FRMCNT"),
+    CMD("+MSIZE"), CMD("+RFQ"), CMD("+DWELL"), CMD("+MAXEIRP"), CMD("+RSSITH"),
+    CMD("+CST"), CMD("+BACKOFF"), CMD("+CHMASK"), CMD("+RTYNUM"),
+    CMD("+NETID"), CMD("$VER"), CMD("$DBG"), CMD("$HALT"), CMD("$JOINEUI"),
+    CMD("$NWKKEY"), CMD("$APPKEY"), CMD("$FNWKSINTKEY"), CMD("$SNWKSINTKEY"),
+    CMD("$NWKSENCKEY"), CMD("$CHMASK"), CMD("$RX2"), CMD("$DR"),
+    CMD("$RFPOWER"), CMD("$LOGLEVEL"), CMD("$CERT"), CMD("$SESSION"),
+    CMD("$CW"), CMD("$CM"), CMD("$NVM"), CMD("$APKACCESS"), CMD("$FRAME"),
+    CMD("$UARTSTAT"), CMD("$MAILBOX"), CMD("$RECV"), CMD("$RECVDEL"),
+    CMD("$QTX"), CMD("$FDATA"), CMD("$FTX"), CMD("$FTXDEL"), CMD("$HANDLES"),
+    CMD("$TXDONE"), CMD("$AGGR"), CMD("$CONFIG"), CMD("$UARTSTATRST"),
+    CMD("+CLAC"), CMD("$HELP")
+};
+
+#define NUM_COMMANDS ATCI_COMMANDS_LENGTH(commands)
+
+
+static const atci_command_t *reference_find_command(const char *name, size_t name_len)
+{
+    const atci_command_t *cmd;
+    size_t cmd_len;
+
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        cmd = commands + i;
+        cmd_len = strlen(cmd->command);
+
+        if (name_len < cmd_len) continue;
+        if (strncmp(name, cmd->command, cmd_len) != 0) continue;
+        if (cmd_len == name_len || name[cmd_len] == '=' || name[cmd_len] == '?')
+            return cmd;
+    }
+    return NULL;
+}
+
+
+static const atci_command_t *hash_find_command(char *name, size_t name_len)
+{
+    size_t len = 0;
+
+    while (len < name_len && name[len] != '=' && name[len] != '?' && name[len] != ' ')
+        len++;
+    return atci_find_command(name, len);
+}
+
+
+int main(void)
+{
+    char lines[NUM_COMMANDS + 1][32];
+    size_t lengths[NUM_COMMANDS + 1];
+    const atci_command_t *a, *b;
+    double start, ref, hash;
+
+    atci_init(0, commands, NUM_COMMANDS);
+
+    for (size_t i = 0; i < NUM_COMMANDS; i++)
+        lengths[i] = snprintf(lines[i], sizeof(lines[i]), "%s?", commands[i].command);
+    lengths[NUM_COMMANDS] = snprintf(lines[NUM_COMMANDS], sizeof(lines[0]), "+UNKNOWN?");
+
+    for (size_t i = 0; i <= NUM_COMMANDS; i++) {
+        a = reference_find_command(lines[i], lengths[i]);
+        b = hash_find_command(lines[i], lengths[i]);
+        if (a != b || (i < NUM_COMMANDS && a != commands + i)) {
+            fprintf(stderr, "Lookups disagree on %s\n", lines[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    start = bench_now();
+    for (int n = 0; n < ITERATIONS; n++)
+        for (size_t i = 0; i <= NUM_COMMANDS; i++)
+            bench_use(reference_find_command(lines[i], lengths[i]));
+    ref = (bench_now() - start) / ITERATIONS / (NUM_COMMANDS + 1) * 1e9;
+
+    start = bench_now();
+    for (int n = 0; n < ITERATIONS; n++)
+        for (size_t i = 0; i <= NUM_COMMANDS; i++)
+            bench_use(hash_find_command(lines[i], lengths[i]));
+    hash = (bench_now() - start) / ITERATIONS / (NUM_COMMANDS + 1) * 1e9;
+
+    printf("%zu commands\n", NUM_COMMANDS);
+    printf("%16s %16s %8s\n", "linear [ns/op]", "hash [ns/op]", "speedup");
+    printf("%16.1f %16.1f %7.1fx\n", ref, hash, ref / hash);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+// A host benchmark of atci_print_buffer_as_hex. It compares the byte-pair
+// lookup table encoder from src/atci.c with the previous implementation, which
+// computed one nibble per output character, for payloads of several sizes.
+// Both encoders stream their output into the (stubbed) LPUART TX FIFO. Run
+// with "make bench". The absolute numbers only apply to the host; the ratio is
+// what matters.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "atci.h"
+#include "lpuart.h"
+#include "bench.h"
+
+#define ITERATIONS 200000
+
+
+static size_t reference_print_buffer_as_hex(const void *buffer, size_t length)
+{
+    const uint8_t *src = buffer;
+    size_t avail, i = 0, n = length * 2;
+    uint8_t nibble;
+    char *dst;
+
+    while (i < n) {
+        avail = 1;
+        dst = lpuart_reserve(&avail);
+        if (avail > n - i) avail = n - i;
+
+        for (size_t j = 0; j < avail; j++, i++) {
+            nibble = i % 2 ? src[i / 2] & 0x0f : src[i / 2] >> 4;
+            dst[j] = nibble < 10 ? nibble + '0' : nibble - 10 + 'A';
+        }
+        lpuart_commit(avail);
+    }
+
+    return n;
+}
+
+
+static double run(size_t (*encode)(const void *, size_t), const uint8_t *data, size_t length)
+{
+    double start = bench_now();
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        encode(data, length);
+        bench_use(data);
+    }
+    return (bench_now() - start) / ITERATIONS / length * 1e9;
+}
+
+
+static int check(const uint8_t *data, size_t length)
+{
+    char a[2 * 256], b[2 * 256];
+    cbuf_view_t head;
+
+    lpuart_flush();
+    reference_print_buffer_as_hex(data, length);
+    cbuf_copy_out(a, cbuf_head(&lpuart_tx_fifo, &head), sizeof(a));
+
+    lpuart_flush();
+    atci_print_buffer_as_hex(data, length);
+    cbuf_copy_out(b, cbuf_head(&lpuart_tx_fifo, &head), sizeof(b));
+
+    return memcmp(a, b, length * 2);
+}
+
+
+int main(void)
+{
+    static const size_t sizes[] = { 4, 16, 51, 242 };
+    uint8_t data[256];
+    double ref, lut;
+
+    atci_init(0, NULL, 0);
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = rand();
+
+    printf("%8s %16s %16s %8s\n", "bytes", "nibble [ns/B]", "table [ns/B]", "speedup");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (check(data, sizes[i])) {
+            fprintf(stderr, "Encoders disagree on %zu bytes\n", sizes[i]);
+            return EXIT_FAILURE;
+        }
+
+        ref = run(reference_print_buffer_as_hex, data, sizes[i]);
+        lut = run(atci_print_buffer_as_hex, data, sizes[i]);
+        printf("%8zu %16.2f %16.2f %7.1fx\n", sizes[i], ref, lut, ref / lut);
+    }
+    return EXIT_SUCCESS;
+}
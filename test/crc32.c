@@ -0,0 +1,99 @@
+// A host-side test for the table-driven CRC-32 in src/crc32.c. The checksum is
+// compared against a bit-by-bit reference, the algorithm Crc32 from
+// LoRaWAN/Utilities used before, for all lengths up to MAX_LENGTH at every
+// alignment of the input, and for data split into two chained updates at every
+// possible point. The Crc32 and Crc32Update wrappers are checked as well. Run
+// with "make test".
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "crc32.h"
+#include "LoRaWAN/Utilities/utilities.h"
+
+#define MAX_LENGTH 300
+#define ALIGNMENTS 4
+
+
+static uint8_t data[MAX_LENGTH + ALIGNMENTS];
+
+
+static uint32_t reference(uint32_t crc, const uint8_t *p, size_t length)
+{
+    while (length--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320UL & -(crc & 1));
+    }
+    return crc;
+}
+
+
+static inline uint32_t xorshift(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+
+int main(void)
+{
+    uint32_t rnd = 0x12345678, expected, crc;
+    unsigned long checks = 0;
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = xorshift(&rnd);
+
+    // The well-known check value of CRC-32 for the ASCII string "123456789"
+    if (~crc32_update(CRC32_INIT, "123456789", 9) != 0xCBF43926UL) {
+        fprintf(stderr, "Wrong check value\n");
+        return EXIT_FAILURE;
+    }
+
+    for (size_t offset = 0; offset < ALIGNMENTS; offset++) {
+        const uint8_t *p = data + offset;
+
+        for (size_t length = 0; length <= MAX_LENGTH; length++) {
+            expected = reference(CRC32_INIT, p, length);
+
+            crc = crc32_update(CRC32_INIT, p, length);
+            if (crc != expected) {
+                fprintf(stderr, "Mismatch at offset %zu, length %zu: %08lX != %08lX\n",
+                    offset, length, (unsigned long)crc, (unsigned long)expected);
+                return EXIT_FAILURE;
+            }
+
+            if (Crc32((uint8_t *)p, length) != ~expected) {
+                fprintf(stderr, "Crc32 mismatch at offset %zu, length %zu\n", offset, length);
+                return EXIT_FAILURE;
+            }
+
+            // Chaining must not depend on where the data is split, including
+            // splits that leave either part unaligned
+            for (size_t split = 0; split <= length; split++) {
+                crc = crc32_update(CRC32_INIT, p, split);
+                crc = crc32_update(crc, p + split, length - split);
+                if (crc != expected) {
+                    fprintf(stderr, "Chained mismatch at offset %zu, length %zu, split %zu\n",
+                        offset, length, split);
+                    return EXIT_FAILURE;
+                }
+
+                crc = Crc32Update(CRC32_INIT, (uint8_t *)p, split);
+                crc = Crc32Update(crc, (uint8_t *)p + split, length - split);
+                if (Crc32Finalize(crc) != ~expected) {
+                    fprintf(stderr, "Crc32Update mismatch at offset %zu, length %zu, split %zu\n",
+                        offset, length, split);
+                    return EXIT_FAILURE;
+                }
+                checks++;
+            }
+        }
+    }
+
+    printf("crc32: %lu chained checksums OK\n", checks);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+// Definitions that let selected firmware modules compile on the development
+// host. The file is force-included (-include) into every source file of the
+// host test programs. It replaces the Cortex-M intrinsics from cmsis_gcc.h
+// used by irq.h with no-ops, since the host programs have no interrupts.
+
+#ifndef __TEST_HOST_H__
+#define __TEST_HOST_H__
+
+#include <stdint.h>
+
+#define __CMSIS_GCC_H
+#define __STATIC_FORCEINLINE static inline
+
+static inline uint32_t __get_PRIMASK(void) { return 0; }
+static inline void __set_PRIMASK(uint32_t mask) { (void)mask; }
+static inline void __disable_irq(void) {}
+static inline void __enable_irq(void) {}
+
+#endif // __TEST_HOST_H__
@@ -0,0 +1,89 @@
+// Host replacements for the LPUART driver and other platform modules used by
+// src/atci.c. The TX FIFO is drained instantly whenever the producer runs out
+// of space, as if the DMA transfer completed immediately, so that the programs
+// measure the cost of producing output only.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "lpuart.h"
+#include "halt.h"
+
+volatile unsigned system_sleep_lock;
+volatile unsigned system_stop_lock;
+
+volatile cbuf_t lpuart_tx_fifo;
+volatile cbuf_t lpuart_rx_fifo;
+
+static char tx_buffer[512];
+static char rx_buffer[512];
+
+
+void lpuart_init(unsigned int baudrate)
+{
+    (void)baudrate;
+    cbuf_init(&lpuart_tx_fifo, tx_buffer, sizeof(tx_buffer));
+    cbuf_init(&lpuart_rx_fifo, rx_buffer, sizeof(rx_buffer));
+}
+
+
+size_t lpuart_write(const char *buffer, size_t length)
+{
+    return cbuf_put(&lpuart_tx_fifo, buffer, length);
+}
+
+
+void lpuart_write_blocking(const char *buffer, size_t length)
+{
+    size_t n;
+
+    while (length) {
+        n = cbuf_put(&lpuart_tx_fifo, buffer, length);
+        if (n == 0) lpuart_flush();
+        buffer += n;
+        length -= n;
+    }
+}
+
+
+char *lpuart_reserve(size_t *length)
+{
+    char *p;
+
+    if (*length > lpuart_tx_fifo.size) return NULL;
+
+    while ((p = cbuf_reserve(&lpuart_tx_fifo, length)) == NULL) {
+        if (cbuf_length(&lpuart_tx_fifo) == 0) {
+            // The free space wraps around. Restart at the beginning of the
+            // memory block like the target driver does once the FIFO drains.
+            lpuart_tx_fifo.read = lpuart_tx_fifo.write = 0;
+        } else {
+            lpuart_flush();
+        }
+    }
+    return p;
+}
+
+
+void lpuart_commit(size_t length)
+{
+    cbuf_commit(&lpuart_tx_fifo, length);
+}
+
+
+size_t lpuart_consume(size_t length)
+{
+    return cbuf_consume(&lpuart_rx_fifo, length);
+}
+
+
+void lpuart_flush(void)
+{
+    cbuf_consume(&lpuart_tx_fifo, cbuf_length(&lpuart_tx_fifo));
+}
+
+
+void halt(const char *msg)
+{
+    fprintf(stderr, "halt: %s\n", msg);
+    abort();
+}